@@ -0,0 +1,49 @@
+//=====================================================
+// libm2disk.h
+// Lilith disk image library interface
+//
+// Lilith Machine Disk Utility
+//
+// Guido Hoss, 25.03.2022
+//
+// Published by Guido Hoss under GNU Public License V3.
+//=====================================================
+
+#ifndef _LIBM2DISK_H
+#define _LIBM2DISK_H   1
+
+#include "m2disk.h"
+#include "m2d_medos.h"
+#include "m2d_dir.h"
+#include "m2d_dircache.h"
+#include "m2d_pagemap.h"
+#include "m2d_listdir.h"
+#include "m2d_import.h"
+#include "m2d_extract.h"
+#include "m2d_delete.h"
+#include "m2d_select.h"
+#include "m2d_stats.h"
+#include "m2d_trace.h"
+
+
+// Flags for m2d_open()
+#define M2D_CREATE		1	// Create a new (empty) image file
+#define M2D_FORCE		2	// Overwrite an existing file on create
+#define M2D_VERBOSE		4	// Verbose output on stdout
+#define M2D_STATS		8	// Collect I/O statistics
+#define M2D_NOMAP		16	// Use file I/O instead of a memory mapping
+#define M2D_SYNC		32	// Sync image to storage when writing back
+
+
+// Function declarations
+//
+m2d_image_t *m2d_open(const char *name, uint16_t flags);
+bool m2d_set_geometry(m2d_image_t *img, uint16_t cyls);
+bool m2d_sync(m2d_image_t *img);
+bool m2d_close(m2d_image_t *img);
+const char *m2d_error(m2d_image_t *img);
+void m2d_set_report(m2d_image_t *img, void (*report)(const char *msg));
+void m2d_set_verbose(m2d_image_t *img, bool verbose);
+bool m2d_same_image(m2d_image_t *img, const char *name);
+
+#endif
@@ -0,0 +1,467 @@
+//=====================================================
+// m2d_bench.c
+// End-to-end benchmark driver for libm2disk
+//
+// Lilith Machine Disk Utility
+//
+// Guido Hoss, 25.03.2022
+//
+// Published by Guido Hoss under GNU Public License V3.
+//=====================================================
+
+// nftw() needs the X/Open extensions
+#define _GNU_SOURCE
+
+#include <string.h>
+#include <limits.h>
+#include <ftw.h>
+#include <sys/stat.h>
+#include "libm2disk.h"
+
+
+// Default number of repetitions of each benchmark
+#define BENCH_REPEAT	5
+
+// Maximum number of results and length of a result name
+#define BENCH_MAX		32
+#define BENCH_NAME_LEN	24
+
+// Result of a single benchmark
+typedef struct {
+	char name[BENCH_NAME_LEN];
+	double ops;				// Operations per second
+	double mbs;				// Megabytes per second (0 = n/a)
+} bench_result_t;
+
+// Synthetic host file set
+typedef struct {
+	char *name;				// Workload name
+	uint16_t n;				// Number of files
+	uint32_t size;			// Size of each file in bytes
+	bool text;				// Text files (imported with conversion)
+	char **files;			// Host file names
+} workload_t;
+
+static bench_result_t result[BENCH_MAX];
+static uint16_t n_result = 0;
+static char *work_dir;
+static uint16_t repeat = BENCH_REPEAT;
+
+
+// add_result()
+// Records the fastest of the measured times for "ops" operations
+// on "bytes" bytes
+//
+static void add_result(char *name, double best, uint32_t ops, uint64_t bytes)
+{
+	if (n_result == BENCH_MAX)
+		error(1, 0, "Too many benchmarks");
+
+	bench_result_t *r = &result[n_result ++];
+	snprintf(r->name, BENCH_NAME_LEN, "%s", name);
+	r->ops = ops / best;
+	r->mbs = bytes / best / 1e6;
+}
+
+
+// open_image()
+// Opens (or creates) a benchmark image; exits on failure
+//
+static m2d_image_t *open_image(char *name, bool create)
+{
+	m2d_image_t *img = m2d_open(name,
+		create ? (M2D_CREATE | M2D_FORCE) : 0);
+
+	if (img == NULL)
+		error(1, errno, "Can't open image '%s'", name);
+	return img;
+}
+
+
+// close_image()
+// Closes a benchmark image; exits on failure
+//
+static void close_image(m2d_image_t *img, char *name)
+{
+	if (! m2d_close(img))
+		error(1, 0, "Can't write image '%s'", name);
+}
+
+
+// make_files()
+// Generates the host files of a workload. Binary files contain
+// pseudo-random bytes, text files lines of random words.
+//
+static void make_files(workload_t *w)
+{
+	static const char *word[] = {
+		"MODULE", "BEGIN", "END", "PROCEDURE", "VAR", "CARDINAL",
+		"IF", "THEN", "ELSE", "WHILE", "DO", "RETURN", "IMPORT",
+		"FROM", "Lilith", "Medos", "FileSystem", ":=", ";", "(*", "*)"
+	};
+	uint32_t seed = 4711;
+	char dir[PATH_MAX];
+	uint8_t *buf = malloc(w->size);
+
+	snprintf(dir, PATH_MAX, "%s/%s", work_dir, w->name);
+	if ((buf == NULL) || (mkdir(dir, 0777) != 0))
+		error(1, errno, "Can't create workload '%s'", w->name);
+
+	w->files = calloc(w->n, sizeof(char *));
+	for (uint16_t i = 0; i < w->n; i ++)
+	{
+		uint32_t k = 0;
+
+		while (k < w->size)
+		{
+			seed = seed * 1103515245 + 12345;
+			if (! w->text)
+			{
+				buf[k ++] = seed >> 16;
+				continue;
+			}
+
+			// Random word, followed by a line break every 8th time
+			const char *s = word[(seed >> 16) % (sizeof(word) / sizeof(char *))];
+			while ((*s != '\0') && (k < w->size))
+				buf[k ++] = *(s ++);
+			if (k < w->size)
+				buf[k ++] = ((seed >> 8) % 8 == 0) ? '\n' : ' ';
+		}
+
+		char name[PATH_MAX];
+		if (snprintf(name, PATH_MAX, "%s/F%04d.%s", dir, i,
+			w->text ? "MOD" : "BIN") >= PATH_MAX)
+			error(1, 0, "Work directory name too long");
+
+		FILE *f = fopen(name, "w");
+		if ((f == NULL) || (fwrite(buf, w->size, 1, f) != 1)
+			|| (fclose(f) != 0))
+			error(1, errno, "Can't write '%s'", name);
+
+		w->files[i] = strdup(name);
+	}
+	free(buf);
+}
+
+
+// bench_format()
+// Times creation of an empty image with m2d_init_image()
+//
+static void bench_format(char *img_name)
+{
+	double best = 1e9;
+
+	for (uint16_t r = 0; r < repeat; r ++)
+	{
+		double t = m2d_now();
+		m2d_image_t *img = open_image(img_name, true);
+
+		if (! m2d_init_image(img))
+			error(1, 0, "%s", m2d_error(img));
+		close_image(img, img_name);
+
+		t = m2d_now() - t;
+		if (t < best)
+			best = t;
+	}
+	add_result("format", best, 1, DK_IMAGE_SZ);
+}
+
+
+// bench_list()
+// Times a full directory listing via m2d_traverse(), with
+// entries formatted into memory instead of printed
+//
+static void bench_list(char *wl_name, char *img_name)
+{
+	double best = 1e9;
+	uint16_t n = 0;
+
+	bool list_entry(dir_entry_t *d, void *ctx)
+	{
+		char line[80];
+
+		snprintf(line, sizeof(line), "%-26.26s%4d%9d",
+			d->name, d->filenum, d->len);
+		(* (uint16_t *) ctx) ++;
+		return true;
+	}
+
+	for (uint16_t r = 0; r < repeat; r ++)
+	{
+		// Reopen each time so the directory is read from the image
+		double t = m2d_now();
+		m2d_image_t *img = open_image(img_name, false);
+
+		n = 0;
+		if (! m2d_traverse(img, NULL, DE_NAME | DE_INFO, list_entry, &n))
+			error(1, 0, "%s", m2d_error(img));
+		close_image(img, img_name);
+
+		t = m2d_now() - t;
+		if (t < best)
+			best = t;
+	}
+
+	char name[BENCH_NAME_LEN];
+	snprintf(name, BENCH_NAME_LEN, "list-%s", wl_name);
+	add_result(name, best, n, 0);
+}
+
+
+// bench_import()
+// Times a batch import of all workload files into an empty
+// image. The image of the last run is kept in img_name.
+//
+static void bench_import(workload_t *w, char *img_name)
+{
+	double best = 1e9;
+
+	for (uint16_t r = 0; r < repeat; r ++)
+	{
+		m2d_image_t *img = open_image(img_name, true);
+
+		if (! m2d_init_image(img))
+			error(1, 0, "%s", m2d_error(img));
+		close_image(img, img_name);
+
+		double t = m2d_now();
+		uint16_t count;
+
+		img = open_image(img_name, false);
+		if (! (m2d_load_pagemap(img) && m2d_import(
+			img, w->files, w->n, false, w->text, 1, &count)))
+			error(1, 0, "%s", m2d_error(img));
+		close_image(img, img_name);
+
+		t = m2d_now() - t;
+		if (count != w->n)
+			error(1, 0, "Only %d of %d files imported", count, w->n);
+		if (t < best)
+			best = t;
+	}
+
+	char name[BENCH_NAME_LEN];
+	snprintf(name, BENCH_NAME_LEN, "import-%s", w->name);
+	add_result(name, best, w->n, (uint64_t) w->n * w->size);
+}
+
+
+// bench_extract()
+// Times extraction of all workload files from the image
+// into host files
+//
+static void bench_extract(workload_t *w, char *img_name)
+{
+	char dir[PATH_MAX];
+	char cwd[PATH_MAX];
+	double best = 1e9;
+
+	snprintf(dir, PATH_MAX, "%s/%s.out", work_dir, w->name);
+	if ((getcwd(cwd, PATH_MAX) == NULL) || (mkdir(dir, 0777) != 0)
+		|| (chdir(dir) != 0))
+		error(1, errno, "Can't create '%s'", dir);
+
+	for (uint16_t r = 0; r < repeat; r ++)
+	{
+		double t = m2d_now();
+		m2d_image_t *img = open_image(img_name, false);
+
+		if (! m2d_extract(img, NULL, true, w->text, X_FILES, NULL, 1))
+			error(1, 0, "%s", m2d_error(img));
+		close_image(img, img_name);
+
+		t = m2d_now() - t;
+		if (t < best)
+			best = t;
+	}
+	if (chdir(cwd) != 0)
+		error(1, errno, "Can't change to '%s'", cwd);
+
+	char name[BENCH_NAME_LEN];
+	snprintf(name, BENCH_NAME_LEN, "extract-%s", w->name);
+	add_result(name, best, w->n, (uint64_t) w->n * w->size);
+}
+
+
+// load_baseline()
+// Reads a stored baseline into b[]; returns the number of
+// entries (0 if the file can't be read)
+//
+static uint16_t load_baseline(char *fname, bench_result_t *b)
+{
+	char line[128];
+	uint16_t n = 0;
+	FILE *f = fopen(fname, "r");
+
+	if (f == NULL)
+	{
+		error(0, errno, "Can't read baseline '%s'", fname);
+		return 0;
+	}
+
+	while ((n < BENCH_MAX) && (fgets(line, sizeof(line), f) != NULL))
+	{
+		if ((line[0] != '#') && (sscanf(line, "%23s %lf %lf",
+			b[n].name, &b[n].ops, &b[n].mbs) == 3))
+			n ++;
+	}
+	fclose(f);
+	return n;
+}
+
+
+// remove_entry()
+// nftw() callback to delete a file or (empty) directory of the
+// work directory tree
+//
+static int remove_entry(
+	const char *path, const struct stat *st, int flag, struct FTW *ftw
+) {
+	(void) st;
+	(void) flag;
+	(void) ftw;
+	return remove(path);
+}
+
+
+// save_baseline()
+// Writes the current results as new baseline
+//
+static void save_baseline(char *fname)
+{
+	FILE *f = fopen(fname, "w");
+
+	if (f == NULL)
+		error(1, errno, "Can't write baseline '%s'", fname);
+
+	fprintf(f, "# m2d_bench baseline: name ops/s MB/s\n");
+	for (uint16_t i = 0; i < n_result; i ++)
+		fprintf(f, "%s %.1f %.2f\n", result[i].name, result[i].ops,
+			result[i].mbs);
+
+	if (fclose(f) != 0)
+		error(1, errno, "Can't write baseline '%s'", fname);
+}
+
+
+// print_results()
+// Prints all results, with the change against the baseline
+//
+static void print_results(bench_result_t *b, uint16_t nb)
+{
+	printf("%-20s %12s %10s %10s\n", "benchmark", "ops/s", "MB/s", "baseline");
+
+	for (uint16_t i = 0; i < n_result; i ++)
+	{
+		bench_result_t *r = &result[i];
+
+		printf("%-20s %12.1f ", r->name, r->ops);
+		if (r->mbs > 0)
+			printf("%10.2f ", r->mbs);
+		else
+			printf("%10s ", "-");
+
+		// Compare ops/s with baseline entry of the same name
+		for (uint16_t j = 0; j < nb; j ++)
+		{
+			if ((strcmp(b[j].name, r->name) == 0) && (b[j].ops > 0))
+			{
+				printf("%+9.1f%%", (r->ops / b[j].ops - 1) * 100);
+				break;
+			}
+		}
+		printf("\n");
+	}
+}
+
+
+int main(int argc, char **argv)
+{
+	char c;
+	char *baseline = NULL;
+	char *save = NULL;
+	bool keep = false;
+
+	while ((c = getopt(argc, argv, "b:w:n:k")) != -1)
+	{
+		switch (c)
+		{
+			case 'b' :
+				baseline = optarg;
+				break;
+
+			case 'w' :
+				save = optarg;
+				break;
+
+			case 'n' :
+				repeat = atoi(optarg);
+				if (repeat < 1)
+					error(1, 0, "Number of repetitions must be positive");
+				break;
+
+			case 'k' :
+				keep = true;
+				break;
+
+			default :
+				error(1, 0,
+					"USAGE: m2d_bench [-k] [-n repeat] [-b baseline] [-w new_baseline]");
+				break;
+		}
+	}
+
+	// All files are created in a temporary work directory
+	char tmpl[PATH_MAX];
+	char *tmp = getenv("TMPDIR");
+	snprintf(tmpl, PATH_MAX, "%s/m2d_bench.XXXXXX", tmp ? tmp : "/tmp");
+	if ((work_dir = mkdtemp(tmpl)) == NULL)
+		error(1, errno, "Can't create work directory");
+
+	// Synthetic workloads: a directory filled to its limit with
+	// small files, maximum size (96 page) files, and text sources
+	workload_t wl[] = {
+		{ "full",	DK_NUM_FILES - 9,	1024,		false,	NULL },
+		{ "max",	40,		M2D_PAGETAB_LEN * 8 * DK_SECTOR_SZ,	false,	NULL },
+		{ "text",	200,	16384,		true,	NULL }
+	};
+	uint16_t n_wl = sizeof(wl) / sizeof(workload_t);
+
+	for (uint16_t i = 0; i < n_wl; i ++)
+		make_files(&wl[i]);
+
+	char img_name[PATH_MAX];
+	snprintf(img_name, PATH_MAX, "%s/bench.img", work_dir);
+
+	// Empty image
+	bench_format(img_name);
+	bench_list("empty", img_name);
+
+	for (uint16_t i = 0; i < n_wl; i ++)
+	{
+		bench_import(&wl[i], img_name);
+		bench_list(wl[i].name, img_name);
+		bench_extract(&wl[i], img_name);
+	}
+
+	bench_result_t b[BENCH_MAX];
+	uint16_t nb = (baseline != NULL) ? load_baseline(baseline, b) : 0;
+	print_results(b, nb);
+
+	if (save != NULL)
+		save_baseline(save);
+
+	// Remove work directory
+	if (! keep)
+	{
+		if (nftw(work_dir, remove_entry, 16, FTW_DEPTH | FTW_PHYS) != 0)
+			error(0, errno, "Can't remove '%s'", work_dir);
+	}
+	else
+	{
+		printf("Work files kept in %s\n", work_dir);
+	}
+	return 0;
+}
@@ -0,0 +1,678 @@
+//=====================================================
+// m2d_cli.c
+// Command line interface, shared by m2disk and m2diskd
+//
+// Lilith Machine Disk Utility
+//
+// Guido Hoss, 25.03.2022
+//
+// Published by Guido Hoss under GNU Public License V3.
+//=====================================================
+
+#include <config.h>
+#include <string.h>
+#include <fcntl.h>
+#include "libm2disk.h"
+#include "m2d_usage.h"
+#include "m2d_cli.h"
+
+// Maximum number of parallel jobs (-j)
+#define M2D_MAX_JOBS	64
+
+// Maximum number of arguments of a script command
+#define M2D_MAX_ARGS	256
+
+// Implemented operation modes
+typedef enum {
+	M_LISTDIR,
+	M_EXTRACT,
+	M_IMPORT,
+	M_FORMAT,
+	M_PAGETAB,
+	M_DELETE,
+	M_UNKNOWN
+} mode_type;
+
+
+// report()
+// Prints warnings from the library
+//
+static void report(const char *msg)
+{
+	error(0, 0, "%s", msg);
+}
+
+
+// Script commands and the options they stand for
+static const struct {
+	const char *cmd;
+	char *opt;
+} script_cmd[] = {
+	{ "list", "-l" },
+	{ "pagetab", "-p" },
+	{ "extract", "-x" },
+	{ "import", "-i" },
+	{ "delete", "-r" }
+};
+#define NUM_SCRIPT_CMDS	(sizeof(script_cmd) / sizeof(script_cmd[0]))
+
+
+// split_line()
+// Splits a script line into at most max words, which may be
+// quoted with ' or ". A # outside quotes starts a comment.
+// Returns the number of words, or -1 if the line is invalid.
+//
+static int split_line(char *line, char **word, int max)
+{
+	int n = 0;
+	char *p = line;
+
+	while (true)
+	{
+		while (isspace(*p))
+			p ++;
+		if ((*p == '\0') || (*p == '#'))
+			return n;
+		if (n == max)
+			return -1;
+
+		// Copy word in place, removing quotes
+		char *q = p;
+		char quote = '\0';
+
+		word[n ++] = q;
+		while ((*p != '\0') && (quote || (! isspace(*p))))
+		{
+			if (*p == quote)
+				quote = '\0';
+			else if ((quote == '\0') && ((*p == '\'') || (*p == '"')))
+				quote = *p;
+			else
+				*(q ++) = *p;
+			p ++;
+		}
+		if (quote != '\0')
+			return -1;
+		if (*p != '\0')
+			p ++;
+		*q = '\0';
+	}
+}
+
+
+// run_script()
+// Executes the commands in file "script" ("-" for standard input)
+// on the opened image. Each line holds a command (list, pagetab,
+// extract, import or delete) followed by the options and arguments
+// of the corresponding m2disk function, without the image file name.
+// Options of a command only apply to that command; "verbose" and
+// "stats" are the settings of the script itself. Changes are not
+// written back in between. Stops at the first failing command and
+// returns FALSE; the changes of the preceding commands are still
+// written back to the image.
+//
+static bool run_script(
+	m2d_image_t *img, char *prog, char *imgfile, char *script,
+	bool verbose, bool stats
+) {
+	bool std = (strcmp(script, "-") == 0);
+	FILE *f = std ? stdin : fopen(script, "r");
+
+	if (f == NULL)
+	{
+		error(0, errno, "Can't open script file '%s'", script);
+		return false;
+	}
+
+	char *line = NULL;
+	size_t len = 0;
+	uint32_t lnum = 0;
+	bool res = true;
+
+	while (res && (getline(&line, &len, f) != -1))
+	{
+		char *word[M2D_MAX_ARGS];
+		int n = split_line(line, word, M2D_MAX_ARGS);
+
+		lnum ++;
+		if (n == 0)
+			continue;
+		if (n < 0)
+		{
+			error_at_line(0, 0, script, lnum, "Invalid command line");
+			res = false;
+			break;
+		}
+
+		// Build the command line for the command
+		char *opt = NULL;
+		for (uint16_t i = 0; i < NUM_SCRIPT_CMDS; i ++)
+		{
+			if (strcmp(word[0], script_cmd[i].cmd) == 0)
+				opt = script_cmd[i].opt;
+		}
+		if (opt == NULL)
+		{
+			error_at_line(0, 0, script, lnum, "Unknown command '%s'", word[0]);
+			res = false;
+			break;
+		}
+
+		char *args[n + 3];
+		args[0] = prog;
+		args[1] = opt;
+		args[2] = imgfile;
+		for (int i = 1; i < n; i ++)
+			args[i + 2] = word[i];
+		args[n + 2] = NULL;
+
+		VERBOSE(img, "> %s:%u: %s\n", script, lnum, word[0])
+		if (m2d_cli(n + 2, args, img, false) != 0)
+		{
+			error_at_line(0, 0, script, lnum, "Command '%s' failed", word[0]);
+			res = false;
+		}
+
+		// Options of the command don't carry over to the next one
+		m2d_set_report(img, report);
+		m2d_set_verbose(img, verbose);
+		if (! stats)
+			m2d_stats_start(img, false);
+	}
+	if (ferror(f))
+	{
+		error(0, errno, "Can't read script file '%s'", script);
+		res = false;
+	}
+
+	free(line);
+	if (! std)
+		fclose(f);
+	return res;
+}
+
+
+// m2d_cli()
+// Executes the m2disk command line in argv and returns the exit
+// status. If "hot" is set, the command works on this already
+// opened image instead of opening img_file itself, and changes
+// are only written back to it if "commit" is set.
+//
+int m2d_cli(int argc, char **argv, m2d_image_t *hot, bool commit)
+{
+	char c;
+	char *imgfile = NULL;
+	m2d_image_t *img = NULL;
+	char *outdir = NULL;
+	m2d_select_t *sel = NULL;
+	char *exclude[argc];
+	char *lists[argc];
+	uint16_t nexclude = 0, nlists = 0;
+	char *tracefile = NULL;
+	char *script = NULL;
+	int home = -1;
+	mode_type mode = M_UNKNOWN;
+	bool force = false;
+	bool convert = false;
+	bool verbose = false;
+	bool sync = false;
+	bool names = false;
+	bool res = true;
+	bool reported = false;		// Failure already reported
+	uint16_t stats = 0;
+	extract_mode_t xmode = X_FILES;
+	FILE *out = NULL;
+	uint16_t jobs = 1;
+	uint16_t cyls = 0;
+
+	// Ends the command; the image is only closed if it was opened here.
+	// Standard output and the current directory are restored for the
+	// next command of a script or daemon.
+	int finish(bool ok)
+	{
+		if (out != NULL)
+		{
+			fflush(stdout);
+			if ((fflush(out) != 0) && ok)
+			{
+				error(0, errno, "Can't write to standard output");
+				ok = false;
+			}
+			dup2(fileno(out), STDOUT_FILENO);
+			fclose(out);
+		}
+
+		if (home != -1)
+		{
+			if (fchdir(home) != 0)
+			{
+				error(0, errno, "Can't change back to working directory");
+				ok = false;
+			}
+			close(home);
+		}
+
+		if ((img != NULL) && (tracefile != NULL) && (! m2d_trace_stop(img)))
+			error(0, 0, "%s", m2d_error(img));
+
+		if ((img != NULL) && (hot == NULL) && (! m2d_close(img)))
+		{
+			error(0, 0, "Image file '%s' not updated", imgfile);
+			ok = false;
+		}
+		m2d_select_free(sel);
+		return ok ? 0 : 1;
+	}
+
+	// Parse command line options (reinitializing getopt, since the
+	// daemon parses a new command line for every request)
+	opterr = 0;
+	optind = 0;
+	while ((c = getopt (argc, argv, M2D_OPTIONS)) != -1)
+	{
+		switch (c)
+		{
+			case 'c' :
+				mode = M_FORMAT;
+				break;
+
+			case 'e' :
+				// Exclude pattern
+				exclude[nexclude ++] = optarg;
+				break;
+
+			case 'L' :
+				// File with list of names or patterns
+				lists[nlists ++] = optarg;
+				break;
+
+			case 'n' :
+				// List names only
+				names = true;
+				break;
+
+			case 'g' :
+				// Number of cylinders of a new image
+				cyls = atoi(optarg);
+				break;
+
+			case 'l' :
+				mode = M_LISTDIR;
+				break;
+
+			case 'x' :
+				mode = M_EXTRACT;
+				break;
+
+			case 'i' :
+				mode = M_IMPORT;
+				break;
+
+			case 'p' :
+				mode = M_PAGETAB;
+				break;
+
+			case 'r' :
+				mode = M_DELETE;
+				break;
+
+			case 'b' :
+				// A script line can't start another script, which
+				// could run the calling one again
+				if ((hot != NULL) && (! commit))
+				{
+					error(0, 0, "Scripts can't be nested");
+					return 1;
+				}
+				script = optarg;
+				break;
+
+			case 'd' :
+				outdir = optarg;
+				break;
+
+			case 'j' : {
+				char *end;
+				long n = strtol(optarg, &end, 10);
+
+				if ((end == optarg) || (*end != '\0') || (n < 1))
+				{
+					error(0, 0, "Invalid number of jobs '%s'", optarg);
+					return 1;
+				}
+
+				// More threads than M2D_MAX_JOBS don't pay off
+				jobs = (n > M2D_MAX_JOBS) ? M2D_MAX_JOBS : n;
+				break;
+			}
+
+			case 'v' :
+				verbose = true;
+				break;
+
+			case 's' :
+				sync = true;
+				break;
+
+			case 'f' :
+				force = true;
+				break;
+
+			case 't' :
+				convert = true;
+				break;
+
+			case 'O' :
+				xmode = X_STREAM;
+				break;
+
+			case 'a' :
+				xmode = X_TAR;
+				break;
+
+			case 'S' :
+				// Once for a summary, twice for machine-readable output
+				stats ++;
+				break;
+
+			case 'T' :
+				tracefile = optarg;
+				break;
+
+			case 'D' :
+				// Daemon socket; handled by the client
+				break;
+
+			case 'h' :
+				m2d_usage();
+				return 0;
+
+			case 'V' :
+				m2d_version();
+				return 0;
+
+			case '?' :
+				error(0, 0,
+					"Unrecognized option (run \"" PACKAGE " -h\" for help)."
+				);
+				return 1;
+
+			default :
+				break;
+		}
+	}
+
+	// When extracting to standard output, send all other (verbose)
+	// output to standard error instead
+	if ((mode == M_EXTRACT) && (xmode != X_FILES))
+	{
+		int fd = dup(STDOUT_FILENO);
+
+		fflush(stdout);
+		if ((fd == -1) || (dup2(STDERR_FILENO, STDOUT_FILENO) == -1)
+			|| ((out = fdopen(fd, "w")) == NULL))
+		{
+			error(0, errno, "Can't write to standard output");
+			return finish(false);
+		}
+	}
+
+	// Check for image_file
+	if (optind < argc)
+	{
+		// Get image file name
+		imgfile = argv[optind];
+		if (verbose)
+		{
+			m2d_version();
+			printf("> Image file name: %s\n", imgfile);
+		}
+
+		if (hot != NULL)
+		{
+			// The daemon serves only its own image, and only as it is
+			if (! m2d_same_image(hot, imgfile))
+			{
+				error(0, 0, "Image file '%s' is not served by this daemon",
+					imgfile);
+				return finish(false);
+			}
+			if (mode == M_FORMAT)
+			{
+				error(0, 0, commit
+					? "Can't format an image served by a daemon"
+					: "Can't format the image from a script");
+				return finish(false);
+			}
+			img = hot;
+			if (verbose)
+				m2d_set_verbose(img, true);
+			if (stats)
+				m2d_stats_start(img, true);
+		}
+		else
+		{
+			m2d_geom_t geo;
+
+			// Check the geometry before the image file is created
+			if ((mode == M_FORMAT) && (cyls != 0)
+				&& (! m2d_init_geom(&geo, cyls)))
+			{
+				error(0, 0, "Unsupported disk geometry (%d cylinders)", cyls);
+				return finish(false);
+			}
+
+			// In format mode, overwrite existing files only if forced
+			img = m2d_open(imgfile,
+				((mode == M_FORMAT) ? M2D_CREATE : 0)
+				| (force ? M2D_FORCE : 0)
+				| (verbose ? M2D_VERBOSE : 0)
+				| (stats ? M2D_STATS : 0)
+				| (sync ? M2D_SYNC : 0)
+			);
+		}
+		if (img == NULL)
+		{
+			if (errno == EEXIST)
+			{
+				error(0, 0,
+					"Image file '%s' exists (use -f to overwrite)",
+					imgfile
+				);
+			}
+			else
+				error(0, errno, "Can't open image file '%s'", imgfile);
+			return finish(false);
+		}
+		m2d_set_report(img, report);
+
+		if ((tracefile != NULL) && (! m2d_trace_start(img, tracefile)))
+		{
+			error(0, 0, "%s", m2d_error(img));
+			return finish(false);
+		}
+	}
+	else
+	{
+		error(0, 0, "No image file specified.");
+		return finish(false);
+	}
+
+	// Compile the file selection from all file_arg arguments,
+	// exclude patterns and list files
+	switch (mode)
+	{
+		case M_EXTRACT :
+		case M_LISTDIR :
+		case M_PAGETAB :
+		case M_DELETE :
+			if ((sel = m2d_select_new()) == NULL)
+			{
+				error(0, errno, "Can't allocate file selection");
+				return finish(false);
+			}
+			for (int i = optind + 1; i < argc; i ++)
+			{
+				VERBOSE(img, "> File argument: '%s'\n", argv[i])
+				res = res && m2d_select_add(sel, argv[i], false);
+			}
+			for (uint16_t i = 0; i < nexclude; i ++)
+			{
+				VERBOSE(img, "> Excluded: '%s'\n", exclude[i])
+				res = res && m2d_select_add(sel, exclude[i], true);
+			}
+			if (! res)
+			{
+				error(0, errno, "Can't compile file selection");
+				return finish(false);
+			}
+			for (uint16_t i = 0; i < nlists; i ++)
+			{
+				VERBOSE(img, "> File list: '%s'\n", lists[i])
+				if (! m2d_select_add_file(sel, lists[i], false))
+				{
+					error(0, errno, "Can't read file list '%s'", lists[i]);
+					return finish(false);
+				}
+			}
+			if (! m2d_select_explicit(sel))
+				VERBOSE(img, "> File argument: '*'\n")
+			break;
+
+		default :
+			break;
+	}
+
+	if (force)
+		VERBOSE(img, "> Force mode enabled; existing files will be overwritten\n")
+
+	// A script replaces the program function
+	if (script != NULL)
+		mode = M_UNKNOWN;
+
+	// Execute requested program function
+	switch (mode)
+	{
+		case M_LISTDIR :
+			res = names ? m2d_list_names(img, sel) 
+				: m2d_list_dir(img, sel);
+			VERBOSE(img, "\n")
+			break;
+
+		case M_EXTRACT :
+			// Check if output directory exists and change to it
+			if ((outdir != NULL) && (*outdir != '\0'))
+			{
+				// Scripts and daemons continue in the current directory
+				home = open(".", O_RDONLY | O_DIRECTORY);
+				if (home == -1)
+				{
+					error(0, errno, "Can't open working directory");
+					return finish(false);
+				}
+				if (chdir(outdir) != 0)
+				{
+					error(0, errno, "Invalid output directory '%s'", outdir);
+					return finish(false);
+				}
+			}
+			if (verbose)
+				VERBOSE(img, "> Destination dir: '%s'\n", outdir ? outdir : ".")
+			if (convert)
+				VERBOSE(img, "> Text file conversion enabled\n")
+			VERBOSE(img, "\n")
+
+			res = m2d_extract(img, sel, force, convert, xmode, out, jobs);
+			break;
+
+		case M_IMPORT : {
+			// Import files into image
+			uint16_t ok = 0;
+			if (convert)
+				VERBOSE(img, "> Text file conversion enabled\n")
+
+			// Load pagemap since we must find unused sectors
+			res = m2d_get_pagemap(img);
+
+			// Import all source file arguments in one batch
+			if (res && (optind + 1 < argc))
+			{
+				res = m2d_import(img, &argv[optind + 1],
+					argc - optind - 1, force, convert, jobs, &ok);
+			}
+			if (ok == 0)
+				VERBOSE(img, "> No files imported.\n")
+			VERBOSE(img, "\n")
+			break;
+		}
+
+		case M_FORMAT :
+			// Create new (empty) image file
+			res = ((cyls == 0) || m2d_set_geometry(img, cyls))
+				&& m2d_init_image(img);
+			if (res)
+				VERBOSE(img, "> Image file created successfully.\n")
+			break;
+
+		case M_PAGETAB :
+			// Print page table of specified file(s)
+			res = m2d_list_pagetab(img, sel);
+			break;
+
+		case M_DELETE : {
+			// Delete files from image
+			uint16_t ok = 0;
+
+			if (! m2d_select_explicit(sel))
+			{
+				error(0, 0, "No files to delete specified");
+				res = false;
+				reported = true;
+				break;
+			}
+			res = m2d_delete(img, sel, force, &ok);
+			if (ok == 0)
+				VERBOSE(img, "> No files deleted.\n")
+			VERBOSE(img, "\n")
+			break;
+		}
+
+		default :
+			if (script != NULL)
+			{
+				res = run_script(img, argv[0], imgfile, script, 
+					verbose, stats);
+				break;
+			}
+			error(0, 0,
+				"Unknown or no function specified"
+				" (run \"" PACKAGE " -h\" for help)."
+			);
+			break;
+	}
+
+	// Failing script commands have already been reported
+	if ((! res) && (script == NULL) && (! reported))
+		error(0, 0, "%s", m2d_error(img));
+
+	// Write back changes first so that the commit phase is included;
+	// a daemon writes back after every request
+	if (stats || ((hot != NULL) && commit))
+	{
+		if (! m2d_sync(img))
+		{
+			error(0, 0, "%s", m2d_error(img));
+			res = false;
+		}
+	}
+	if (stats)
+	{
+		m2d_stats_t st;
+
+		m2d_get_stats(img, &st);
+		m2d_print_stats(&st, (stats > 1));
+	}
+
+	// Write back directory changes and close image file
+	return finish(res);
+}
@@ -0,0 +1,25 @@
+//=====================================================
+// m2d_cli.h
+// Command line interface, shared by m2disk and m2diskd
+//
+// Lilith Machine Disk Utility
+//
+// Guido Hoss, 25.03.2022
+//
+// Published by Guido Hoss under GNU Public License V3.
+//=====================================================
+
+#ifndef _M2D_CLI_H
+#define _M2D_CLI_H   1
+
+#include "m2disk.h"
+
+// Command line options for getopt()
+#define M2D_OPTIONS		"VvlxhpftOad:icj:ST:D:rb:sg:ne:L:"
+
+
+// Function declarations
+//
+int m2d_cli(int argc, char **argv, m2d_image_t *hot, bool commit);
+
+#endif
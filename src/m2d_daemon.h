@@ -0,0 +1,32 @@
+//=====================================================
+// m2d_daemon.h
+// Protocol between m2disk and the m2diskd daemon
+//
+// Lilith Machine Disk Utility
+//
+// Guido Hoss, 25.03.2022
+//
+// Published by Guido Hoss under GNU Public License V3.
+//=====================================================
+
+#ifndef _M2D_DAEMON_H
+#define _M2D_DAEMON_H   1
+
+#include "m2disk.h"
+
+// Maximum total length of the arguments of a request
+#define M2D_MAX_REQUEST		(4 * 1024 * 1024)
+
+// File descriptors passed with a request: the client's standard
+// input, output and error, and its current directory
+#define M2D_REQ_FDS		4
+
+// A request consists of this header, followed by "len" bytes of
+// argc NUL-terminated arguments. The daemon replies with the exit
+// status of the command as an int32_t.
+struct m2d_request_t {
+	uint32_t argc;		// Number of arguments
+	uint32_t len;		// Total length of arguments
+};
+
+#endif
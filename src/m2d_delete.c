@@ -0,0 +1,71 @@
+//=====================================================
+// m2d_delete.c
+// High-level file deletion
+//
+// Lilith Machine Disk Utility
+//
+// Guido Hoss, 25.03.2022
+//
+// Published by Guido Hoss under GNU Public License V3.
+//=====================================================
+
+#include "m2d_image.h"
+#include "m2d_dir.h"
+#include "m2d_delete.h"
+
+
+// Deletion state passed to the traversal callback
+typedef struct {
+	m2d_image_t *img;		// Image handle
+	bool force;				// Delete protected files
+	bool res;				// FALSE if the directory can't be updated
+	uint16_t count;			// Number of files deleted
+} delete_job_t;
+
+
+// delete_file()
+// Traversal callback to delete a directory entry
+//
+static bool delete_file(dir_entry_t *d, void *ctx)
+{
+	delete_job_t *job = ctx;
+	m2d_image_t *img = job->img;
+
+	if (d->reserved)
+	{
+		m2d_warn(img, 0, "Reserved file '%s' can't be deleted", d->name);
+		return true;
+	}
+	if (d->protected && (! job->force))
+	{
+		m2d_warn(img, 0, "File '%s' is protected (use -f)", d->name);
+		return true;
+	}
+
+	// A loaded page map is kept up to date; otherwise it is
+	// rebuilt from the directory when needed
+	job->res = m2d_free_file(img, d->filenum)
+		&& m2d_unregister_file(img, d->filenum);
+	if (job->res)
+	{
+		VERBOSE(img, "> Deleted '%s'\n", d->name)
+		job->count ++;
+	}
+	return job->res;
+}
+
+
+// m2d_delete()
+// Deletes all files selected by sel from the image and releases
+// their pages. Reserved files are never deleted, protected files
+// only in force mode. Returns the number of deleted files in count.
+//
+bool m2d_delete(
+	m2d_image_t *img, const m2d_select_t *sel, bool force, uint16_t *count
+) {
+	delete_job_t job = { .img = img, .force = force, .res = true };
+	bool res = m2d_traverse(img, sel, DE_NAME | DE_INFO, delete_file, &job);
+
+	*count = job.count;
+	return res && job.res;
+}
@@ -0,0 +1,25 @@
+//=====================================================
+// m2d_delete.h
+// High-level file deletion
+//
+// Lilith Machine Disk Utility
+//
+// Guido Hoss, 25.03.2022
+//
+// Published by Guido Hoss under GNU Public License V3.
+//=====================================================
+
+#ifndef _M2D_DELETE_H
+#define _M2D_DELETE_H   1
+
+#include "m2disk.h"
+#include "m2d_select.h"
+
+
+// Forward declarations
+//
+bool m2d_delete(
+	m2d_image_t *img, const m2d_select_t *sel, bool force, uint16_t *count
+);
+
+#endif
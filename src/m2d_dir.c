@@ -10,128 +10,179 @@
 //=====================================================
 
 #include <string.h>
-#include <fnmatch.h>
 #include <byteswap.h>
+#include "m2d_image.h"
+#include "m2d_dircache.h"
 #include "m2d_dir.h"
 
 
-// m2d_traverse()
-// Traverse directory
+// count_pages()
+// Returns the number of pages in a page table
 //
-void m2d_traverse(FILE *f, char *filearg, bool (*callproc)(dir_entry_t *))
+static uint16_t count_pages(uint16_t *pt)
 {
-	struct disk_sector_t s;
+	uint16_t n = 0;
+
+	while ((n < M2D_PAGETAB_LEN) && (bswap_16(pt[n]) != DK_NIL_PAGE))
+		n ++;
+	return n;
+}
+
+
+// make_dir_entry()
+// Fills in the fields (DE_xxx) of the consolidated directory entry
+// of file number fnum from its name and file descriptors. Returns
+// FALSE if the descriptors don't belong together.
+//
+static bool make_dir_entry(
+	m2d_image_t *img, uint16_t fnum, struct name_desc_t *ndp, 
+	uint16_t fields, dir_entry_t *d
+) {
+	// Make null-terminated filename
+	m2d_unpad_name(d->name, ndp->en);
+	d->filenum = fnum;
+
+	// Everything else comes from the file descriptor
+	if (! (fields & (DE_INFO | DE_PAGES)))
+		return true;
+
+	struct file_desc_t *fdp = m2d_dir_filedesc(img, fnum);
+	if (fdp == NULL)
+		return false;
+
+	// Set remaining file info from file descriptor
+	d->reserved = bswap_16(fdp->reserved);
+	if (d->filenum != bswap_16(fdp->file_num))
+		return m2d_fail(img, 0, "Directory entry mismatch (file# %d)", fnum);
+
+	struct fd_father_t *fa = &fdp->fdk.father;
+	d->protected = bswap_16(fa->prot_flag);
+	d->len = bswap_16(fa->len.sectors) * DK_SECTOR_SZ 
+		+ bswap_16(fa->len.bytes);
+
+	memcpy(&d->mtime, &fa->mtime, sizeof(struct tm_minute_t));
+	memcpy(&d->ctime, &fa->ctime, sizeof(struct tm_minute_t));
 
-	// Scan all sectors in name directory
-	for (uint16_t i = 0; i < DK_NAMEDIR_LEN; i ++)
+	if (! (fields & DE_PAGES))
+		return true;
+
+	// Copy page table
+	memcpy(d->page_tab, fdp->page_tab, sizeof(d->page_tab));
+
+	// Collect the son descriptors which the file length requires;
+	// they continue the page table of the father
+	uint32_t need = (d->len + 8 * DK_SECTOR_SZ - 1) / (8 * DK_SECTOR_SZ);
+	uint16_t nsons = (need > M2D_PAGETAB_LEN) 
+		? (need - 1) / M2D_PAGETAB_LEN : 0;
+
+	d->nsons = 0;
+	d->pages = count_pages(fdp->page_tab);
+	for (uint16_t j = 0; (j < nsons) && (j < M2D_MAX_SONS - 1); j ++)
+	{
+		uint16_t sfnum = bswap_16(fa->sontab[j]);
+		struct file_desc_t *sfdp = m2d_dir_filedesc(img, sfnum);
+		if ((sfdp == NULL) || (sfdp->fd_kind != bswap_16(FDK_SON))
+			|| (bswap_16(sfdp->fdk.son.father_num) != fnum)
+			|| (bswap_16(sfdp->fdk.son.son_num) != j + 1))
+			return m2d_fail(img, 0, "Son descriptor mismatch (file# %d)", fnum);
+
+		d->sons[d->nsons ++] = sfnum;
+		d->pages += count_pages(sfdp->page_tab);
+	}
+	return true;
+}
+
+
+// m2d_traverse()
+// Traverse directory, passing the requested fields (DE_xxx) of
+// each entry selected by sel (all if NULL) to callproc, together
+// with the caller's context ctx. The file directory is only read
+// if fields other than DE_NAME are requested. Returns FALSE if
+// the directory can't be read or is inconsistent.
+//
+bool m2d_traverse(
+	m2d_image_t *img, const m2d_select_t *sel, uint16_t fields,
+	bool (*callproc)(dir_entry_t *d, void *ctx), void *ctx
+) {
+	m2d_phase_t ph = m2d_phase_begin(img, PH_DIRSCAN);
+	bool res = true;
+
+	// Scan all entries in name directory
+	for (uint16_t i = 0; (i < DK_NUM_FILES) && res; i ++)
 	{
-		if (! m2d_read_sector(f, &s, DK_NAME_START + i))
+		struct name_desc_t *ndp = m2d_dir_namedesc(img, i);
+		if (ndp == NULL)
+		{
+			res = false;
 			break;
+		}
 
-		// Scan name entries in each sector
-		for (uint16_t j = 0; j < DK_NUM_ND_SECT; j ++)
+		// Skip free entries
+		if (ndp->nd_kind == bswap_16(NDK_FNAME))
 		{
-			struct name_desc_t *ndp = &s.type.nd[j];
+			dir_entry_t d;
+
+			// Check if the file is selected
+			m2d_unpad_name(d.name, ndp->en);
+			if (! m2d_select_match(sel, d.name))
+				continue;
 
-			// Skip free entries
-			if (ndp->nd_kind == bswap_16(NDK_FNAME))
+			if (! make_dir_entry(img, i, ndp, fields, &d))
 			{
-				dir_entry_t d;
-
-				// Make null-terminated filename
-				strncpy(d.name, ndp->en, M2D_EXTNAME_LEN);
-				for (int16_t k = M2D_EXTNAME_LEN; k >= 0; k --)
-				{
-					if (d.name[k] == ' ')
-						d.name[k] = '\0';
-				}
-
-				// Check if filename pattern matches
-				if ((filearg != NULL) 
-					&& (fnmatch(filearg, d.name, FNM_PATHNAME) != 0))
-					continue;
-
-				// Load associated file descriptor from disk
-				d.filenum = (i * DK_NUM_ND_SECT) + j;
-
-				struct disk_sector_t s1;
-				if (! m2d_read_sector(f, &s1, DK_DIR_START + d.filenum))
-					break;
-
-				// Copy page table
-				struct file_desc_t *fdp = &s1.type.fd;
-				memcpy(d.page_tab, fdp->page_tab, sizeof(d.page_tab));
-
-				// Set remaining file info from file descriptor
-				d.reserved = bswap_16(fdp->reserved);
-				if (d.filenum != bswap_16(fdp->file_num))
-					error(1, 0, 
-						"Directory entry mismatch (file# %d)", d.filenum
-					);
-
-				struct fd_father_t *fa = &s1.type.fd.fdk.father;
-				d.protected = bswap_16(fa->prot_flag);
-				d.len = bswap_16(fa->len.sectors) * DK_SECTOR_SZ 
-					+ bswap_16(fa->len.bytes);
-
-				memcpy(&d.mtime, &fa->mtime, sizeof(struct tm_minute_t));
-				memcpy(&d.ctime, &fa->ctime, sizeof(struct tm_minute_t));
-
-				// Callback procedure
-				callproc(&d);
+				res = false;
+				break;
 			}
+
+			// Callback procedure; stop traversal if it returns FALSE
+			if (! callproc(&d, ctx))
+				break;
 		}
 	}
+	m2d_phase_end(img, ph);
+	return res;
 }
 
 
 // m2d_lookup_file()
 // Checks for the directory entry with specified filename
 // Returns TRUE and the directory entry if file found.
-// Returns FALSE and the index of the first free directory
-// entry in d.idx if file not found
+// Returns FALSE and the first free file number in d.filenum
+// if file not found (DK_NUM_FILES if the directory is full)
 //
-bool m2d_lookup_file(FILE *f, char *fn, dir_entry_t *d)
+bool m2d_lookup_file(m2d_image_t *img, char *fn, dir_entry_t *d)
 {
-	int16_t curr_idx = -1;
-	int16_t first_free = -1;
-	bool found = false;
+	int16_t fnum = m2d_dir_find(img, fn);
 
-	bool check_entry(dir_entry_t *dt)
+	if (fnum >= 0)
 	{
-		if (strcmp(dt->name, fn) == 0)
-		{
-			// Entry exists; copy its information to caller
-			memcpy(d, dt, sizeof(dir_entry_t));
-			found = true;
-			return false;
-		}
-
-		// If not found, check for free gaps in file# sequence
-		if (dt->filenum > curr_idx + 1)
-		{
-			if (first_free == -1)
-				first_free = curr_idx + 1;
-		}
-		curr_idx = dt->filenum;
-		return true;
+		// Entry exists; copy its information to caller
+		return make_dir_entry(img, fnum, m2d_dir_namedesc(img, fnum), 
+			DE_ALL, d);
 	}
 
-	// Scan all directory entries
-	m2d_traverse(f, NULL, check_entry);
-
 	// If not found, report first free directory entry
-	if (! found)
-	{
-		d->reserved = d->protected = bswap_16(0);
-		
-		if (first_free != -1)
-			d->filenum = first_free;
-		else if (curr_idx < DK_NUM_FILES - 2)
-			d->filenum = curr_idx + 1;
-		else
-			error(1, 0, "Directory full");
-	}
+	d->reserved = d->protected = bswap_16(0);
+
+	fnum = m2d_dir_free_filenum(img);
+	d->filenum = (fnum >= 0) ? fnum : DK_NUM_FILES;
+	return false;
+}
+
 
-	return found;
-}
\ No newline at end of file
+// m2d_file_page()
+// Returns page table entry i of the file in directory entry d,
+// continuing into its son descriptors, or DK_NIL_PAGE beyond the
+// end of the file
+//
+uint16_t m2d_file_page(m2d_image_t *img, dir_entry_t *d, uint16_t i)
+{
+	uint16_t k = i / M2D_PAGETAB_LEN;
+
+	if (k == 0)
+		return bswap_16(d->page_tab[i]);
+	if (k > d->nsons)
+		return DK_NIL_PAGE;
+
+	struct file_desc_t *fdp = m2d_dir_filedesc(img, d->sons[k - 1]);
+	return bswap_16(fdp->page_tab[i % M2D_PAGETAB_LEN]);
+}
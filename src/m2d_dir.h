@@ -14,6 +14,7 @@
 
 #include "m2d_medos.h"
 #include "m2d_time.h"
+#include "m2d_select.h"
 
 // Consolidated directory entry
 typedef struct {
@@ -25,12 +26,26 @@ typedef struct {
 	struct tm_minute_t ctime;			// Creation time
 	struct tm_minute_t mtime;			// Modification time
 	uint16_t page_tab[M2D_PAGETAB_LEN];	// Pages used by file
+	uint16_t pages;						// Number of pages incl. sons
+	uint16_t nsons;						// Number of son descriptors
+	uint16_t sons[M2D_MAX_SONS - 1];	// File numbers of sons
 } dir_entry_t;
 
+// Fields of dir_entry_t filled in by m2d_traverse(). Only the
+// name fields can be supplied without reading the file directory.
+#define DE_NAME		1		// name, filenum
+#define DE_INFO		2		// reserved, protected, len, ctime, mtime
+#define DE_PAGES	4		// page_tab, pages, nsons, sons (implies DE_INFO)
+#define DE_ALL		(DE_NAME | DE_INFO | DE_PAGES)
+
 
 // Forward declarations
 //
-void m2d_traverse(FILE *f, char *filearg, bool (*callproc)(dir_entry_t *));
-bool m2d_lookup_file(FILE *f, char *fn, dir_entry_t *d);
+bool m2d_traverse(
+	m2d_image_t *img, const m2d_select_t *sel, uint16_t fields,
+	bool (*callproc)(dir_entry_t *d, void *ctx), void *ctx
+);
+bool m2d_lookup_file(m2d_image_t *img, char *fn, dir_entry_t *d);
+uint16_t m2d_file_page(m2d_image_t *img, dir_entry_t *d, uint16_t i);
 
 #endif
\ No newline at end of file
@@ -0,0 +1,451 @@
+//=====================================================
+// m2d_dircache.c
+// In-memory cache of the file and name directories
+//
+// Lilith Machine Disk Utility
+//
+// Guido Hoss, 25.03.2022
+//
+// Published by Guido Hoss under GNU Public License V3.
+//=====================================================
+
+#include <string.h>
+#include <byteswap.h>
+#include "m2d_image.h"
+#include "m2d_dircache.h"
+
+
+// Size of the name hash table (power of 2)
+#define NAME_HASH_SZ	1024
+
+// Number of words in the free file number bitmap
+#define FREE_MAP_SZ		((DK_NUM_FILES + 63) / 64)
+
+// Cached copy of FS.FileDirectory and FS.NameDirectory
+// of an image, with per-sector dirty flags. Names are indexed
+// in a chained hash table; free file numbers are kept in a
+// bitmap (bit set = free). The file directory is only read when
+// a file descriptor or the free bitmap is first needed, so
+// name-only scans read just the name directory.
+struct m2d_dircache {
+	bool fd_loaded;					// File directory is loaded
+	struct disk_sector_t fd[DK_NUM_FILES];
+	struct disk_sector_t nd[DK_NAMEDIR_LEN];
+	bool fd_dirty[DK_NUM_FILES];
+	bool nd_dirty[DK_NAMEDIR_LEN];
+	int16_t hash_head[NAME_HASH_SZ];
+	int16_t hash_next[DK_NUM_FILES];
+	int16_t hash_bucket[DK_NUM_FILES];
+	uint64_t free_map[FREE_MAP_SZ];
+};
+
+
+// m2d_pad_name()
+// Converts a null-terminated string to a space-padded file name
+//
+void m2d_pad_name(char *m2f, const char *uxf)
+{
+	bool space = false;
+
+	// uxf stays on the terminator of a short name
+	for (uint16_t i = 0; i < M2D_EXTNAME_LEN; i ++)
+	{
+		if (*uxf == '\0')
+			space = true;
+		*m2f = space ? ' ' : *uxf;
+		m2f ++;
+		if (! space)
+			uxf ++;
+	}
+}
+
+
+// m2d_unpad_name()
+// Converts a space-padded file name to a null-terminated string
+// (uxf must hold M2D_EXTNAME_LEN + 1 characters)
+//
+void m2d_unpad_name(char *uxf, const char *m2f)
+{
+	strncpy(uxf, m2f, M2D_EXTNAME_LEN);
+	uxf[M2D_EXTNAME_LEN] = '\0';
+	for (int16_t k = M2D_EXTNAME_LEN; k >= 0; k --)
+	{
+		if (uxf[k] == ' ')
+			uxf[k] = '\0';
+	}
+}
+
+
+// name_hash()
+// Returns the hash bucket of a space-padded file name
+//
+static uint16_t name_hash(const char *en)
+{
+	uint32_t h = 2166136261u;
+
+	for (uint16_t i = 0; i < M2D_EXTNAME_LEN; i ++)
+		h = (h ^ (uint8_t) en[i]) * 16777619u;
+
+	return h & (NAME_HASH_SZ - 1);
+}
+
+
+// update_free()
+// Updates the free bitmap entry of file number fnum; a file
+// number is free if neither a name nor a descriptor use it
+//
+static void update_free(struct m2d_dircache *dir, uint16_t fnum)
+{
+	struct name_desc_t *ndp 
+		= &dir->nd[fnum / DK_NUM_ND_SECT].type.nd[fnum % DK_NUM_ND_SECT];
+	struct file_desc_t *fdp = &dir->fd[fnum].type.fd;
+	uint64_t mask = 1ULL << (fnum % 64);
+
+	if ((ndp->nd_kind == bswap_16(NDK_FNAME)) 
+		|| (fdp->fd_kind != bswap_16(FDK_NOFILE)))
+		dir->free_map[fnum / 64] &= ~mask;
+	else
+		dir->free_map[fnum / 64] |= mask;
+}
+
+
+// update_index()
+// Brings the name index and free bitmap in line with the
+// directory entries of file number fnum
+//
+static void update_index(struct m2d_dircache *dir, uint16_t fnum)
+{
+	struct name_desc_t *ndp 
+		= &dir->nd[fnum / DK_NUM_ND_SECT].type.nd[fnum % DK_NUM_ND_SECT];
+
+	// Remove name from its hash chain
+	int16_t b = dir->hash_bucket[fnum];
+	if (b >= 0)
+	{
+		int16_t *p = &dir->hash_head[b];
+
+		while (*p != fnum)
+			p = &dir->hash_next[*p];
+		*p = dir->hash_next[fnum];
+		dir->hash_bucket[fnum] = -1;
+	}
+
+	// Insert current name at head of its chain
+	if (ndp->nd_kind == bswap_16(NDK_FNAME))
+	{
+		b = name_hash(ndp->en);
+		dir->hash_next[fnum] = dir->hash_head[b];
+		dir->hash_head[b] = fnum;
+		dir->hash_bucket[fnum] = b;
+	}
+
+	// The free bitmap is built once the file directory is loaded
+	if (dir->fd_loaded)
+		update_free(dir, fnum);
+}
+
+
+// clear_index()
+// Empties the name index and free bitmap
+//
+static void clear_index(struct m2d_dircache *dir)
+{
+	for (uint16_t i = 0; i < NAME_HASH_SZ; i ++)
+		dir->hash_head[i] = -1;
+	for (uint16_t i = 0; i < DK_NUM_FILES; i ++)
+		dir->hash_bucket[i] = -1;
+	bzero(dir->free_map, sizeof(dir->free_map));
+}
+
+
+// m2d_dircache_load()
+// Loads the name directory of the image into memory; the file
+// directory follows when it is first accessed. Any previously
+// cached directory is discarded.
+//
+bool m2d_dircache_load(m2d_image_t *img)
+{
+	m2d_dircache_free(img);
+
+	struct m2d_dircache *dir = malloc(sizeof(struct m2d_dircache));
+	if (dir == NULL)
+		return m2d_fail(img, errno, "Can't allocate directory cache");
+
+	dir->fd_loaded = false;
+	bzero(dir->fd_dirty, sizeof(dir->fd_dirty));
+	bzero(dir->nd_dirty, sizeof(dir->nd_dirty));
+
+	m2d_phase_t ph = m2d_phase_begin(img, PH_DIRSCAN);
+	bool res = m2d_read_sectors(img, dir->nd, 
+		img->geo.name_start, DK_NAMEDIR_LEN);
+	m2d_phase_end(img, ph);
+
+	if (! res)
+	{
+		free(dir);
+		return m2d_fail(img, 0, "Can't read image directory");
+	}
+
+	// Build name index; descending order keeps the lowest file
+	// number first in each chain
+	clear_index(dir);
+	for (int16_t i = DK_NUM_FILES - 1; i >= 0; i --)
+		update_index(dir, i);
+
+	img->dir = dir;
+	return true;
+}
+
+
+// load_filedir()
+// Reads the file directory into the loaded directory cache and
+// builds the free file number bitmap
+//
+static bool load_filedir(m2d_image_t *img, struct m2d_dircache *dir)
+{
+	m2d_phase_t ph = m2d_phase_begin(img, PH_DIRSCAN);
+	bool res = m2d_read_sectors(img, dir->fd, 
+		img->geo.dir_start, DK_NUM_FILES);
+	m2d_phase_end(img, ph);
+
+	if (! res)
+		return m2d_fail(img, 0, "Can't read image directory");
+
+	dir->fd_loaded = true;
+	for (uint16_t i = 0; i < DK_NUM_FILES; i ++)
+		update_free(dir, i);
+	return true;
+}
+
+
+// m2d_dircache_create()
+// Starts an empty (all zero) directory for the image without
+// reading it. All entries must be initialized and touched by
+// the caller; they are written when the cache is flushed.
+//
+bool m2d_dircache_create(m2d_image_t *img)
+{
+	m2d_dircache_free(img);
+
+	struct m2d_dircache *dir = calloc(1, sizeof(struct m2d_dircache));
+	if (dir == NULL)
+		return m2d_fail(img, errno, "Can't allocate directory cache");
+
+	dir->fd_loaded = true;
+	clear_index(dir);
+	img->dir = dir;
+	return true;
+}
+
+
+// m2d_dircache_free()
+// Discards the cached directory without writing it
+//
+void m2d_dircache_free(m2d_image_t *img)
+{
+	free(img->dir);
+	img->dir = NULL;
+}
+
+
+// get_dir()
+// Returns the directory cache of the image, loading it from
+// the image if necessary
+//
+static struct m2d_dircache *get_dir(m2d_image_t *img)
+{
+	if ((img->dir == NULL) && (! m2d_dircache_load(img)))
+		return NULL;
+	return img->dir;
+}
+
+
+// get_filedir()
+// Returns the directory cache of the image with its file
+// directory loaded
+//
+static struct m2d_dircache *get_filedir(m2d_image_t *img)
+{
+	struct m2d_dircache *dir = get_dir(img);
+
+	if ((dir != NULL) && (! dir->fd_loaded) && (! load_filedir(img, dir)))
+		return NULL;
+	return dir;
+}
+
+
+// flush_dirty()
+// Writes each run of consecutive modified sectors in s (starting
+// at logical sector n) with a single multi-sector write
+//
+static bool flush_dirty(
+	m2d_image_t *img, struct disk_sector_t *s, bool *dirty, uint16_t n, uint16_t cnt
+) {
+	uint16_t i = 0;
+
+	while (i < cnt)
+	{
+		uint16_t j = i;
+
+		while ((j < cnt) && dirty[j])
+			j ++;
+
+		if (j > i)
+		{
+			if (! m2d_write_sectors(img, &s[i], n + i, j - i))
+				return false;
+			bzero(&dirty[i], j - i);
+		}
+		i = j + 1;
+	}
+	return true;
+}
+
+
+// m2d_dircache_flush()
+// Writes all modified directory sectors back to the image
+//
+bool m2d_dircache_flush(m2d_image_t *img)
+{
+	struct m2d_dircache *dir = img->dir;
+
+	if (dir == NULL)
+		return true;
+
+	m2d_phase_t ph = m2d_phase_begin(img, PH_COMMIT);
+	bool res = ((! dir->fd_loaded) || flush_dirty(img, dir->fd, 
+			dir->fd_dirty, img->geo.dir_start, DK_NUM_FILES))
+		&& flush_dirty(img, dir->nd, dir->nd_dirty, 
+			img->geo.name_start, DK_NAMEDIR_LEN);
+
+	m2d_phase_end(img, ph);
+	return res;
+}
+
+
+// m2d_dir_filedesc()
+// Returns the cached file descriptor of file number fnum,
+// loading the file directory if necessary
+//
+struct file_desc_t *m2d_dir_filedesc(m2d_image_t *img, uint16_t fnum)
+{
+	struct m2d_dircache *dir = get_filedir(img);
+
+	if (dir == NULL)
+		return NULL;
+
+	return (fnum < DK_NUM_FILES) ? &dir->fd[fnum].type.fd : NULL;
+}
+
+
+// m2d_dir_namedesc()
+// Returns the cached name descriptor of file number fnum,
+// loading the directory if necessary
+//
+struct name_desc_t *m2d_dir_namedesc(m2d_image_t *img, uint16_t fnum)
+{
+	struct m2d_dircache *dir = get_dir(img);
+
+	if (dir == NULL)
+		return NULL;
+
+	return (fnum < DK_NUM_FILES) 
+		? &dir->nd[fnum / DK_NUM_ND_SECT].type.nd[fnum % DK_NUM_ND_SECT]
+		: NULL;
+}
+
+
+// m2d_dir_touch_filedesc()
+// Marks the file descriptor of file number fnum as modified
+//
+void m2d_dir_touch_filedesc(m2d_image_t *img, uint16_t fnum)
+{
+	struct m2d_dircache *dir = img->dir;
+
+	if ((dir != NULL) && (fnum < DK_NUM_FILES))
+	{
+		dir->fd_dirty[fnum] = true;
+		update_index(dir, fnum);
+	}
+}
+
+
+// m2d_dir_touch_namedesc()
+// Marks the name descriptor of file number fnum as modified
+//
+void m2d_dir_touch_namedesc(m2d_image_t *img, uint16_t fnum)
+{
+	struct m2d_dircache *dir = img->dir;
+
+	if ((dir != NULL) && (fnum < DK_NUM_FILES))
+	{
+		dir->nd_dirty[fnum / DK_NUM_ND_SECT] = true;
+		update_index(dir, fnum);
+	}
+}
+
+
+// m2d_dir_find()
+// Returns the file number of the file named fname, or -1 if
+// there is no such file. Names longer than M2D_EXTNAME_LEN
+// can't exist and are not truncated to match.
+//
+int16_t m2d_dir_find(m2d_image_t *img, const char *fname)
+{
+	struct m2d_dircache *dir = get_dir(img);
+	char en[M2D_EXTNAME_LEN];
+
+	if ((dir == NULL) || (strnlen(fname, M2D_EXTNAME_LEN + 1)
+		> M2D_EXTNAME_LEN))
+		return -1;
+
+	m2d_pad_name(en, fname);
+
+	for (int16_t i = dir->hash_head[name_hash(en)]; i >= 0;
+		i = dir->hash_next[i])
+	{
+		struct name_desc_t *ndp 
+			= &dir->nd[i / DK_NUM_ND_SECT].type.nd[i % DK_NUM_ND_SECT];
+
+		if (memcmp(ndp->en, en, M2D_EXTNAME_LEN) == 0)
+			return i;
+	}
+	return -1;
+}
+
+
+// m2d_dir_free_filenum()
+// Returns the lowest unused file number, or -1 if the
+// directory is full
+//
+int16_t m2d_dir_free_filenum(m2d_image_t *img)
+{
+	struct m2d_dircache *dir = get_filedir(img);
+
+	if (dir == NULL)
+		return -1;
+
+	for (uint16_t i = 0; i < FREE_MAP_SZ; i ++)
+	{
+		if (dir->free_map[i] != 0)
+			return (i * 64) + __builtin_ctzll(dir->free_map[i]);
+	}
+	return -1;
+}
+
+
+// m2d_dir_count_free()
+// Returns the number of unused file numbers
+//
+uint16_t m2d_dir_count_free(m2d_image_t *img)
+{
+	struct m2d_dircache *dir = get_filedir(img);
+	uint16_t n = 0;
+
+	if (dir == NULL)
+		return 0;
+
+	for (uint16_t i = 0; i < FREE_MAP_SZ; i ++)
+		n += __builtin_popcountll(dir->free_map[i]);
+	return n;
+}
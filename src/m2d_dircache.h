@@ -0,0 +1,34 @@
+//=====================================================
+// m2d_dircache.h
+// In-memory cache of the file and name directories
+//
+// Lilith Machine Disk Utility
+//
+// Guido Hoss, 25.03.2022
+//
+// Published by Guido Hoss under GNU Public License V3.
+//=====================================================
+
+#ifndef _M2D_DIRCACHE_H
+#define _M2D_DIRCACHE_H   1
+
+#include "m2d_medos.h"
+
+
+// Function declarations
+//
+bool m2d_dircache_load(m2d_image_t *img);
+bool m2d_dircache_create(m2d_image_t *img);
+void m2d_dircache_free(m2d_image_t *img);
+bool m2d_dircache_flush(m2d_image_t *img);
+struct file_desc_t *m2d_dir_filedesc(m2d_image_t *img, uint16_t fnum);
+struct name_desc_t *m2d_dir_namedesc(m2d_image_t *img, uint16_t fnum);
+void m2d_dir_touch_filedesc(m2d_image_t *img, uint16_t fnum);
+void m2d_dir_touch_namedesc(m2d_image_t *img, uint16_t fnum);
+int16_t m2d_dir_find(m2d_image_t *img, const char *fname);
+int16_t m2d_dir_free_filenum(m2d_image_t *img);
+uint16_t m2d_dir_count_free(m2d_image_t *img);
+void m2d_pad_name(char *m2f, const char *uxf);
+void m2d_unpad_name(char *uxf, const char *m2f);
+
+#endif
@@ -9,91 +9,355 @@
 // Published by Guido Hoss under GNU Public License V3.
 //=====================================================
 
+#include <fcntl.h>
+#include <string.h>
+#include <pthread.h>
 #include <byteswap.h>
-#include "m2d_medos.h"
+#include "m2d_image.h"
 #include "m2d_dir.h"
+#include "m2d_time.h"
+#include "m2d_text.h"
+#include "m2d_tar.h"
 #include "m2d_extract.h"
 
 
-// Forward declarations
+// A file in the extraction plan
+typedef struct {
+	dir_entry_t d;			// Directory entry
+	uint8_t *buf;			// Contents read from the image
+	uint32_t avail;			// Number of bytes covered by the page table
+} xfile_t;
+
+
+// read_files()
+// Reads the contents of all n files in the work list into memory.
+// The used sectors of all files are collected first and then read
+// in a single forward sweep over the image, scattering them into
+// the buffers of the files.
+//
+static bool read_files(m2d_image_t *img, xfile_t *work, uint16_t n)
+{
+	uint16_t *sect = NULL;
+	struct disk_sector_t **dest = NULL;
+	uint32_t cnt = 0;
+	bool res = true;
+
+	// Adds the used sectors of file x to the schedule (or only counts
+	// them while there is no schedule). Returns the number of sectors.
+	uint32_t schedule(xfile_t *x)
+	{
+		uint32_t len = x->d.len;
+		uint32_t k = 0;
+		uint16_t pe;
+
+		// Loop through each page entry (1 page = 8 sectors), continuing
+		// into the son descriptors
+		for (uint16_t i = 0; (len > 0) && (i < M2D_MAX_PAGES)
+			&& ((pe = m2d_file_page(img, &x->d, i)) != DK_NIL_PAGE); i ++)
+		{
+			// Page entry / 13 = actual page address
+			// (see SEK Medos-2 filesystem thesis p.74)
+			uint16_t page = (pe / 13) * 8;
+
+			// Determine number of used sectors and bytes in page
+			uint16_t max_byte = (len > 8 * DK_SECTOR_SZ)
+				? 8 * DK_SECTOR_SZ : len;
+			uint16_t max_sec = (max_byte + DK_SECTOR_SZ - 1) / DK_SECTOR_SZ;
+
+			for (uint16_t j = 0; j < max_sec; j ++, k ++, cnt ++)
+			{
+				if (sect != NULL)
+				{
+					sect[cnt] = page + j;
+					dest[cnt] = (struct disk_sector_t *) x->buf + k;
+				}
+			}
+			len -= max_byte;
+		}
+		x->avail = x->d.len - len;
+		return k;
+	}
+
+	// Size the file buffers
+	for (uint16_t i = 0; (i < n) && res; i ++)
+	{
+		uint32_t k = schedule(&work[i]);
+
+		if ((work[i].buf = malloc((k > 0) ? k * DK_SECTOR_SZ : 1)) == NULL)
+			res = m2d_fail(img, errno, "Can't allocate '%s'", work[i].d.name);
+	}
+
+	if (res)
+	{
+		sect = malloc((cnt > 0) ? cnt * sizeof(uint16_t) : 1);
+		dest = malloc((cnt > 0) ? cnt * sizeof(struct disk_sector_t *) : 1);
+		if ((sect == NULL) || (dest == NULL))
+			res = m2d_fail(img, errno, "Can't allocate read schedule");
+	}
+
+	if (res)
+	{
+		cnt = 0;
+		for (uint16_t i = 0; i < n; i ++)
+			schedule(&work[i]);
+		res = m2d_read_scatter(img, sect, dest, cnt);
+	}
+	free(sect);
+	free(dest);
+	return res;
+}
+
+
+// copy_file()
+// Writes the contents of file x, as read by read_files(), to the
+// output stream of. The number of bytes written is returned in
+// *written; it is less than the file length if the page table is
+// too short. Returns FALSE if the file can't be written.
+//
+static bool copy_file(
+	m2d_image_t *img, xfile_t *x, FILE *of, bool convert, 
+	uint32_t *written
+) {
+	// Perform optional text conversion
+	if (convert)
+	{
+		m2d_text_convert(x->buf, x->avail, true);
+		m2d_count_convert(img, x->avail);
+	}
+
+	// Write the correct number of bytes to destination
+	if ((x->avail > 0) && (fwrite(x->buf, x->avail, 1, of) != 1))
+	{
+		return m2d_fail(img, errno, 
+			"Can't write %d bytes to '%s'", 
+			x->avail, x->d.name
+		);
+	}
+	if (x->avail != x->d.len)
+		m2d_warn(img, 0, "File length mismatch in '%s'", x->d.name);
+
+	if (written != NULL)
+		*written = x->avail;
+	return true;
+}
+
+
+// extract_file()
+// Creates host file d->name, unless it exists and "force" is not
+// set, and copies the Lilith file into it
+//
+static bool extract_file(
+	m2d_image_t *img, xfile_t *x, bool force, bool convert
+) {
+	dir_entry_t *d = &x->d;
+	int fd = open(d->name, O_WRONLY | O_CREAT | O_TRUNC 
+		| (force ? 0 : O_EXCL), 0666);
+
+	if (fd == -1)
+	{
+		if (errno == EEXIST)
+			return m2d_fail(img, 0, "File '%s' exists (use -f)", d->name);
+		return m2d_fail(img, errno, "Can't create file '%s'", d->name);
+	}
+
+	FILE *of = fdopen(fd, "w");
+	if (of == NULL)
+	{
+		close(fd);
+		return m2d_fail(img, errno, "Can't create file '%s'", d->name);
+	}
+
+	bool res = copy_file(img, x, of, convert, NULL);
+	if ((fclose(of) != 0) && res)
+		res = m2d_fail(img, errno, "Can't write '%s'", d->name);
+	return res;
+}
+
+
+// Work list shared by parallel extraction threads
+typedef struct {
+	m2d_image_t *img;		// Image handle
+	const m2d_select_t *sel;	// Selected files
+	xfile_t *work;			// Files to extract
+	uint16_t size;			// Allocated size of work list
+	uint16_t n;				// Number of files
+	uint16_t next;			// Next file to be claimed by a worker
+	bool force;
+	bool convert;
+	bool failed;			// A worker failed; stop all
+} extract_job_t;
+
+
+// extract_worker()
+// Thread procedure: extracts files from the work list until
+// none are left or one of the workers fails
 //
-void m2d_extract(FILE *f, char *filearg, bool force, bool convert)
+static void *extract_worker(void *arg)
 {
-	bool extract_file(dir_entry_t *d)
+	extract_job_t *job = arg;
+	uint16_t i;
+
+	while ((i = __atomic_fetch_add(&job->next, 1, __ATOMIC_RELAXED)) < job->n)
 	{
-		VERBOSE("%s (%d bytes)... ", d->name, d->len)
-		uint32_t len = d->len;
-		uint16_t i = 0;
+		dir_entry_t *d = &job->work[i].d;
 
-		// Don't export reserved files unless explicitly requested
-		if ((d->reserved) && ((filearg == NULL) || (! force)))
+		if (__atomic_load_n(&job->failed, __ATOMIC_RELAXED)
+			|| (! extract_file(job->img, &job->work[i], job->force, 
+				job->convert)))
 		{
-			VERBOSE("ignored (reserved file, use -f)\n")
-			return true;
+			__atomic_store_n(&job->failed, true, __ATOMIC_RELAXED);
+			break;
 		}
+		VERBOSE(job->img, "%s (%d bytes)... OK\n", d->name, d->len)
+	}
+	return NULL;
+}
+
+
+// add_entry()
+// Traversal callback to add a matching file to the work list
+//
+static bool add_entry(dir_entry_t *d, void *ctx)
+{
+	extract_job_t *job = ctx;
+	m2d_image_t *img = job->img;
+
+	// Don't export reserved files unless explicitly requested
+	if ((d->reserved) && ((! m2d_select_explicit(job->sel)) || (! job->force)))
+	{
+		VERBOSE(img, "%s (%d bytes)... ignored (reserved file, use -f)\n",
+			d->name, d->len)
+		return true;
+	}
 
-		// Page entry / 13 = actual page address
-		// (see SEK Medos-2 filesystem thesis p.74)
-		uint16_t page = (bswap_16(d->page_tab[i]) / 13) * 8;
+	if (job->n == job->size)
+	{
+		uint16_t sz = job->size ? 2 * job->size : 64;
+		xfile_t *w = realloc(job->work, sz * sizeof(xfile_t));
 
-		// Open target file
-		FILE *of = fopen(d->name, "r");
-		if (of != NULL)
+		if (w == NULL)
 		{
-			fclose(of);
-			if (! force)
-				error(1, 0, "File exists (use -f)");
+			job->failed = true;
+			return m2d_fail(img, errno, "Can't allocate work list");
 		}
-		if ((of = fopen(d->name, "w")) == NULL)
-			error(1, errno, "Can't create file");
+		job->work = w;
+		job->size = sz;
+	}
+	memcpy(&job->work[job->n].d, d, sizeof(dir_entry_t));
+	job->work[job->n ++].buf = NULL;
+	return true;
+}
+
+
+// extract_parallel()
+// Extracts the files in the work list into host files using
+// "jobs" concurrent threads
+//
+static bool extract_parallel(extract_job_t *job, uint16_t jobs)
+{
+	pthread_t tid[jobs];
+	uint16_t started = 0;
+
+	for (uint16_t i = 0; i < jobs; i ++)
+	{
+		if (pthread_create(&tid[i], NULL, extract_worker, job) != 0)
+			break;
+		started ++;
+	}
+
+	// Do the work ourselves if no thread could be started
+	if (started == 0)
+		extract_worker(job);
+
+	for (uint16_t i = 0; i < started; i ++)
+		pthread_join(tid[i], NULL);
+
+	return ! job->failed;
+}
 
-		// Loop through each page entry (1 page = 8 sectors)
-		while ((len > 0) && (i < M2D_PAGETAB_LEN)
-			&& ((page != bswap_16(DK_NIL_PAGE))))
+
+// m2d_extract()
+// Extracts all files selected by sel into host files, or as
+// a single stream or tar archive into "out". The matching files
+// are read from the image in one pass, ordered by their physical
+// position, before they are written out. Host files are written
+// by "jobs" parallel threads. Returns FALSE if the extraction
+// failed.
+//
+bool m2d_extract(
+	m2d_image_t *img, const m2d_select_t *sel, bool force, bool convert,
+	extract_mode_t xmode, FILE *out, uint16_t jobs
+) {
+	extract_job_t job = {
+		.img = img, .sel = sel, .force = force, .convert = convert
+	};
+	bool res = true;
+
+	// Writes file x to its destination
+	bool write_entry(xfile_t *x)
+	{
+		dir_entry_t *d = &x->d;
+
+		switch (xmode)
 		{
-			// Determine number of used sectors
-			uint16_t max_sec = ((len > 8 * DK_SECTOR_SZ) 
-				? 8 : (1 + len / DK_SECTOR_SZ));
+			case X_STREAM :
+				res = copy_file(img, x, out, convert, NULL);
+				break;
 
-			// Loop through each used sector
-			for (uint16_t j = 0; j < max_sec; j ++)
-			{
-				// Read sector from image
-				struct disk_sector_t s;
-				m2d_read_sector(f, &s, page + j);
+			case X_TAR : {
+				time_t mtime = m2d_unix_time(&d->mtime);
+				uint32_t n;
 
-				// Find number of used bytes in this sector
-				uint16_t max_byte = (len > DK_SECTOR_SZ)
-					? DK_SECTOR_SZ : len;
+				if (! m2d_tar_header(out, d->name, d->len, mtime))
+					res = m2d_fail(img, errno, "Can't write archive");
 
-				if (max_byte > 0)
+				// Keep the archive aligned even if the file is short
+				else if ((res = copy_file(img, x, out, convert, &n)))
 				{
-					// Perform optional text conversion
-					if (convert)
-						m2d_text_convert(&s, max_byte, true);
-
-					// Write the correct number of bytes to destination
-					if (fwrite(&s, max_byte, 1, of) != 1)
-					{
-						error(1, errno, 
-							"Can't write %d bytes to '%s'", 
-							max_byte, d->name
-						);
-					}
-					len -= max_byte;
+					if (! m2d_tar_pad(out, n, d->len))
+						res = m2d_fail(img, errno, "Can't write archive");
 				}
+				break;
 			}
-			page = (bswap_16(d->page_tab[++ i]) / 13) * 8;
+
+			default :
+				res = extract_file(img, x, force, convert);
+				break;
 		}
-		if (len != 0)
-			error(0, 0, "File length mismatch in '%s'", d->name);
-		
-		fclose(of);
-		VERBOSE("OK\n")
 
-		return true;
-	};
+		if (res)
+			VERBOSE(img, "%s (%d bytes)... OK\n", d->name, d->len)
+		return res;
+	}
 
-	// Check all directory entries for match with "filearg"
-	m2d_traverse(f, filearg, extract_file);
-}
\ No newline at end of file
+	// Collect all selected directory entries
+	if ((! m2d_traverse(img, sel, DE_ALL, add_entry, &job)) || job.failed)
+		res = false;
+
+	if (res && (job.n > 0))
+	{
+		m2d_phase_t ph = m2d_phase_begin(img, PH_TRANSFER);
+
+		res = read_files(img, job.work, job.n);
+		if (res && (xmode == X_FILES) && (jobs > 1))
+		{
+			res = extract_parallel(&job, (job.n < jobs) ? job.n : jobs);
+		}
+		else
+		{
+			for (uint16_t i = 0; (i < job.n) && res; i ++)
+				res = write_entry(&job.work[i]);
+		}
+		m2d_phase_end(img, ph);
+	}
+	for (uint16_t i = 0; i < job.n; i ++)
+		free(job.work[i].buf);
+	free(job.work);
+
+	if (res && (xmode == X_TAR))
+	{
+		if (! m2d_tar_end(out))
+			res = m2d_fail(img, errno, "Can't write archive");
+	}
+	return res;
+}
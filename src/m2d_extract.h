@@ -13,10 +13,22 @@
 #define _M2D_EXTRACT_H   1
 
 #include "m2disk.h"
+#include "m2d_select.h"
+
+
+// Extraction targets
+typedef enum {
+	X_FILES,		// One host file per Lilith file
+	X_STREAM,		// All files concatenated into one stream
+	X_TAR			// Tar archive stream
+} extract_mode_t;
 
 
 // Forward declarations
 //
-void m2d_extract(FILE *f, char *filearg, bool force, bool convert);
+bool m2d_extract(
+	m2d_image_t *img, const m2d_select_t *sel, bool force, bool convert,
+	extract_mode_t xmode, FILE *out, uint16_t jobs
+);
 
 #endif
\ No newline at end of file
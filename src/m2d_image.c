@@ -0,0 +1,787 @@
+//=====================================================
+// m2d_image.c
+// Image file I/O backend
+//
+// Lilith Machine Disk Utility
+//
+// Guido Hoss, 25.03.2022
+//
+// Published by Guido Hoss under GNU Public License V3.
+//=====================================================
+
+#include <string.h>
+#include <stdarg.h>
+#include <byteswap.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include "m2d_image.h"
+#include "m2d_dircache.h"
+#include "m2d_trace.h"
+#include "libm2disk.h"
+
+
+// Logical to physical sector translation table and its inverse
+// (covering the largest supported disk)
+static uint16_t sector_map[DK_MAX_SECTORS];
+static uint16_t sector_unmap[DK_MAX_SECTORS];
+static pthread_once_t sector_map_once = PTHREAD_ONCE_INIT;
+
+// Maximum number of unused sectors read over when coalescing
+// a multi-sector read into a single physical run
+#define M2D_MAX_GAP		16
+
+// Maximum number of buffers in a single vectored read
+#define M2D_MAX_IOV		128
+
+
+// calc_chs_sector()
+// Calculate the actual disk sector in the image from a
+// given logical (sequential) sector number
+//
+static uint16_t calc_chs_sector(uint16_t n)
+{
+	uint16_t c, h, s;	// Cylinder, head, sector
+
+	c = n / N_TRACKS;
+	h = (n / N_SECTORS ) % N_HEADS;
+	s = (n % N_SECTORS) * ((c < 15) ? 3 : 12);
+	s = (s % N_SECTORS) + (s / N_SECTORS);
+
+	return (c * N_TRACKS) + (h * N_SECTORS) + s;
+}
+
+
+// init_sector_map()
+// Precomputes the sector translation table and its inverse
+//
+static void init_sector_map()
+{
+	for (uint16_t i = 0; i < DK_MAX_SECTORS; i ++)
+	{
+		uint16_t sn = calc_chs_sector(i);
+
+		sector_map[i] = sn;
+		sector_unmap[sn] = i;
+	}
+}
+
+
+// calc_image_sector()
+// Returns the physical image sector of logical sector n
+//
+uint16_t calc_image_sector(uint16_t n)
+{
+	pthread_once(&sector_map_once, init_sector_map);
+
+	// Sectors beyond the disk are passed on for error reporting
+	return (n < DK_MAX_SECTORS) ? sector_map[n] : calc_chs_sector(n);
+}
+
+
+// m2d_logical_sector()
+// Returns the logical sector number of physical image sector n
+//
+uint16_t m2d_logical_sector(uint16_t n)
+{
+	pthread_once(&sector_map_once, init_sector_map);
+
+	return (n < DK_MAX_SECTORS) ? sector_unmap[n] : n;
+}
+
+
+// Reference from a physical sector to its destination buffer
+// in a multi-sector request
+struct sect_ref_t {
+	uint16_t phys;					// Physical sector in image
+	struct disk_sector_t *buf;		// Caller's buffer for the sector
+};
+
+
+// sort_sectors()
+// Sorts a multi-sector request by physical position
+//
+static int cmp_phys(const void *a, const void *b)
+{
+	return ((struct sect_ref_t *) a)->phys - ((struct sect_ref_t *) b)->phys;
+}
+
+static void sort_sectors(struct sect_ref_t *ref, uint32_t cnt)
+{
+	qsort(ref, cnt, sizeof(struct sect_ref_t), cmp_phys);
+}
+
+
+// map_image()
+// Maps the whole image file into memory. If "create" is set,
+// the file is first extended to the full image size.
+// Returns FALSE if the image can't be mapped; sector I/O then
+// uses positional reads and writes on the file descriptor.
+//
+static bool map_image(m2d_image_t *img, bool create)
+{
+	struct stat st;
+	int fd = fileno(img->f);
+
+	// Only regular files can be mapped
+	if ((fstat(fd, &st) != 0) || (! S_ISREG(st.st_mode)))
+		return false;
+
+	if (create && (st.st_size < (off_t) img->geo.size))
+	{
+		if (ftruncate(fd, img->geo.size) != 0)
+			return false;
+	}
+	else if (st.st_size < (off_t) img->geo.size)
+	{
+		// Short image; leave it to the fallback to report bad sectors
+		return false;
+	}
+
+	void *p = mmap(
+		NULL, img->geo.size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0
+	);
+	if (p == MAP_FAILED)
+		return false;
+
+	img->map = p;
+	return true;
+}
+
+
+// unmap_image()
+// Writes all modified sectors back to the image file and
+// removes its memory mapping
+//
+static bool unmap_image(m2d_image_t *img)
+{
+	bool res = true;
+
+	if (img->map != NULL)
+	{
+		if (msync(img->map, img->geo.size, MS_SYNC) != 0)
+			res = m2d_fail(img, errno, "Can't write image file");
+
+		munmap(img->map, img->geo.size);
+		img->map = NULL;
+	}
+	return res;
+}
+
+
+// read_raw()
+// Reads logical sector n for geometry detection, before the
+// image is mapped
+//
+static bool read_raw(m2d_image_t *img, struct disk_sector_t *s, uint16_t n)
+{
+	off_t pos = (off_t) calc_image_sector(n) * DK_SECTOR_SZ;
+
+	return pread(fileno(img->f), s, DK_SECTOR_SZ, pos) == DK_SECTOR_SZ;
+}
+
+
+// find_geometry()
+// Returns TRUE if the image has a file directory at sector dir.
+// The geometry is then taken from the position of the directory
+// backup, which is the 2nd file of the directory.
+//
+static bool find_geometry(m2d_image_t *img, uint16_t dir, m2d_geom_t *g)
+{
+	struct disk_sector_t s;
+	struct file_desc_t *fdp = &s.type.fd;
+
+	if (! (read_raw(img, &s, dir) && (fdp->file_num == 0)
+		&& (fdp->fd_kind == bswap_16(FDK_FATHER))
+		&& (fdp->page_tab[0] == bswap_16(dir / 8 * 13))))
+		return false;
+
+	if (! (read_raw(img, &s, dir + 1) && (fdp->file_num == bswap_16(1))
+		&& (fdp->fd_kind == bswap_16(FDK_FATHER))))
+		return false;
+
+	uint16_t back = bswap_16(fdp->page_tab[0]) / 13 * 8;
+	return m2d_init_geom(g, back / N_TRACKS + 9) && (g->dir_start == dir);
+}
+
+
+// detect_geometry()
+// Sets the geometry of an existing image. Images of another size
+// than the standard disk (including partial dumps) are searched for
+// a directory at the places it would have on all disks at least
+// as large as the image. If none is found, the image is treated
+// as a standard disk.
+//
+static void detect_geometry(m2d_image_t *img)
+{
+	off_t sz = lseek(fileno(img->f), 0, SEEK_END);
+	off_t cyls = (sz + N_TRACKS * DK_SECTOR_SZ - 1) / (N_TRACKS * DK_SECTOR_SZ);
+	m2d_geom_t g;
+
+	if ((sz <= 0) || (sz == DK_IMAGE_SZ))
+		return;
+	if (cyls < DK_MIN_CYLS)
+		cyls = DK_MIN_CYLS;
+
+	// Disks with c and c + 1 cylinders share a directory position
+	for (uint16_t c = cyls & ~1; c <= DK_MAX_CYLS; c += 2)
+	{
+		uint16_t dir = (c / 2 - 8) * N_TRACKS;
+
+		if (dir >= sz / DK_SECTOR_SZ)
+			break;
+		if (find_geometry(img, dir, &g))
+		{
+			img->geo = g;
+			VERBOSE(img, "> Disk geometry: %d cylinders\n", g.cyls)
+			break;
+		}
+	}
+}
+
+
+// m2d_set_geometry()
+// Sets the number of cylinders of an image before it is formatted
+// with m2d_init_image(). The image file is remapped to the new size.
+//
+bool m2d_set_geometry(m2d_image_t *img, uint16_t cyls)
+{
+	m2d_geom_t g;
+	bool mapped = (img->map != NULL);
+
+	if (! m2d_init_geom(&g, cyls))
+	{
+		return m2d_fail(img, 0, "Unsupported disk geometry (%d cylinders)",
+			cyls);
+	}
+	if (! unmap_image(img))
+		return false;
+
+	// Cached sectors and directory refer to the old layout
+	m2d_wcache_free(img);
+	m2d_dircache_free(img);
+	img->pagemap_ok = false;
+	img->geo = g;
+
+	if (mapped && (! map_image(img, true)))
+		return m2d_fail(img, errno, "Can't map image file");
+	VERBOSE(img, "> Disk geometry: %d cylinders\n", g.cyls)
+	return true;
+}
+
+
+// m2d_open()
+// Opens image file "name" and returns its handle. With M2D_CREATE,
+// a new file is created; an existing one is only overwritten with
+// M2D_FORCE. Returns NULL with errno set if the file can't be
+// opened (EEXIST if it exists and may not be overwritten).
+//
+m2d_image_t *m2d_open(const char *name, uint16_t flags)
+{
+	bool create = (flags & M2D_CREATE) != 0;
+	FILE *f = fopen(name, "r+");
+
+	if (create)
+	{
+		if (f == NULL)
+		{
+			f = fopen(name, "w+");
+		}
+		else if (flags & M2D_FORCE)
+		{
+			f = freopen(name, "w+", f);
+		}
+		else
+		{
+			fclose(f);
+			errno = EEXIST;
+			return NULL;
+		}
+	}
+	if (f == NULL)
+		return NULL;
+
+	m2d_image_t *img = calloc(1, sizeof(m2d_image_t));
+	if (img == NULL)
+	{
+		fclose(f);
+		errno = ENOMEM;
+		return NULL;
+	}
+
+	img->f = f;
+	img->verbose = (flags & M2D_VERBOSE) != 0;
+	img->sync = (flags & M2D_SYNC) != 0;
+	img->next_page = DK_PAGE_START;
+	pthread_mutex_init(&img->lock, NULL);
+	pthread_mutex_init(&img->trace_lock, NULL);
+	m2d_stats_start(img, (flags & M2D_STATS) != 0);
+
+	// New images get the standard geometry until m2d_set_geometry()
+	m2d_init_geom(&img->geo, DK_NUM_CYLS);
+	if (! create)
+		detect_geometry(img);
+
+	// Map image into memory if possible (stdio is the fallback)
+	if ((! (flags & M2D_NOMAP)) && map_image(img, create))
+		VERBOSE(img, "> Image file mapped into memory\n")
+	return img;
+}
+
+
+// m2d_sync()
+// Writes back all changes to the image file without closing it
+//
+bool m2d_sync(m2d_image_t *img)
+{
+	m2d_phase_t ph = m2d_phase_begin(img, PH_COMMIT);
+	bool res = m2d_dircache_flush(img) && m2d_wcache_flush(img);
+
+	if (res && (img->map != NULL) 
+		&& (msync(img->map, img->geo.size, MS_SYNC) != 0))
+		res = m2d_fail(img, errno, "Can't write image file");
+
+	m2d_phase_end(img, ph);
+	return res;
+}
+
+
+// m2d_close()
+// Writes back all changes to the image, closes the image file
+// and frees the handle. Returns FALSE if the image could not be
+// completely written; the reason goes to the report function.
+//
+bool m2d_close(m2d_image_t *img)
+{
+	bool res = m2d_dircache_flush(img);
+
+	res = m2d_wcache_flush(img) && res;
+	res = unmap_image(img) && res;
+	res = m2d_trace_stop(img) && res;
+	if (fclose(img->f) != 0)
+		res = m2d_fail(img, errno, "Can't close image file");
+
+	if ((! res) && (img->report != NULL))
+		img->report(img->msg);
+
+	m2d_dircache_free(img);
+	m2d_wcache_free(img);
+	pthread_mutex_destroy(&img->lock);
+	pthread_mutex_destroy(&img->trace_lock);
+	free(img);
+	return res;
+}
+
+
+// m2d_verbose()
+// Returns TRUE if verbose output is enabled for the image
+//
+bool m2d_verbose(m2d_image_t *img)
+{
+	return (img != NULL) && img->verbose;
+}
+
+
+// m2d_set_verbose()
+// Enables or disables verbose output for the image
+//
+void m2d_set_verbose(m2d_image_t *img, bool verbose)
+{
+	img->verbose = verbose;
+}
+
+
+// m2d_same_image()
+// Returns TRUE if file "name" is the image file of the handle
+//
+bool m2d_same_image(m2d_image_t *img, const char *name)
+{
+	struct stat st, ist;
+
+	return (stat(name, &st) == 0) && (fstat(fileno(img->f), &ist) == 0)
+		&& (st.st_dev == ist.st_dev) && (st.st_ino == ist.st_ino);
+}
+
+
+// m2d_set_report()
+// Sets the function which receives warnings about the image.
+// Without one, warnings are only available from m2d_error().
+//
+void m2d_set_report(m2d_image_t *img, void (*report)(const char *msg))
+{
+	img->report = report;
+}
+
+
+// m2d_error()
+// Returns the text of the last error or warning on the image
+//
+const char *m2d_error(m2d_image_t *img)
+{
+	return img->msg;
+}
+
+
+// set_error()
+// Formats an error message into the image handle, appending
+// the description of errnum if it is not 0
+//
+static void set_error(
+	m2d_image_t *img, int errnum, const char *fmt, va_list ap
+) {
+	int n = vsnprintf(img->msg, M2D_MSG_LEN, fmt, ap);
+
+	if ((errnum != 0) && (n >= 0) && (n < M2D_MSG_LEN))
+		snprintf(img->msg + n, M2D_MSG_LEN - n, ": %s", strerror(errnum));
+}
+
+
+// m2d_fail()
+// Records an error which ends the current operation.
+// Always returns FALSE.
+//
+bool m2d_fail(m2d_image_t *img, int errnum, const char *fmt, ...)
+{
+	va_list ap;
+
+	pthread_mutex_lock(&img->lock);
+	va_start(ap, fmt);
+	set_error(img, errnum, fmt, ap);
+	va_end(ap);
+	pthread_mutex_unlock(&img->lock);
+	return false;
+}
+
+
+// m2d_warn()
+// Records an error which only affects part of the current
+// operation and passes it to the report function
+//
+void m2d_warn(m2d_image_t *img, int errnum, const char *fmt, ...)
+{
+	va_list ap;
+
+	pthread_mutex_lock(&img->lock);
+	va_start(ap, fmt);
+	set_error(img, errnum, fmt, ap);
+	va_end(ap);
+	if (img->report != NULL)
+		img->report(img->msg);
+	pthread_mutex_unlock(&img->lock);
+}
+
+
+// m2d_map_sector()
+// Returns a pointer to logical sector n. If the image is mapped,
+// this points directly into the image and s is not used; otherwise
+// the sector is read into s. Returns NULL on failure.
+//
+struct disk_sector_t *m2d_map_sector(
+	m2d_image_t *img, struct disk_sector_t *s, uint16_t n
+) {
+	if (img->map != NULL)
+	{
+		uint16_t sn = calc_image_sector(n);
+
+		if (sn >= img->geo.sectors)
+		{
+			m2d_fail(img, EINVAL, "read_sector(%d) failed", sn);
+			return NULL;
+		}
+		m2d_trace(img, TR_READ, n, 1);
+		m2d_count_io(img, false, sn, 1, 0);
+		return (struct disk_sector_t *) (img->map + sn * DK_SECTOR_SZ);
+	}
+	return m2d_read_sector(img, s, n) ? s : NULL;
+}
+
+
+// write_sector()
+// Writes sector number n to disk without tracing the access
+//
+static bool write_sector(m2d_image_t *img, struct disk_sector_t *s, uint16_t n)
+{
+	n = calc_image_sector(n);
+
+	if (n >= img->geo.sectors)
+		return m2d_fail(img, EINVAL, "write_sector(%d) failed", n);
+
+	if (img->map == NULL)
+	{
+		// Written to the file when the cache is flushed
+		return m2d_wcache_put(img, n, s);
+	}
+
+	// Sectors obtained by m2d_map_sector() are already in place
+	uint8_t *p = img->map + n * DK_SECTOR_SZ;
+	if ((uint8_t *) s != p)
+		memcpy(p, s, DK_SECTOR_SZ);
+
+	m2d_count_io(img, true, n, 1, 0);
+	return true;
+}
+
+
+// read_sector()
+// Reads sector number n from disk without tracing the access
+//
+static bool read_sector(m2d_image_t *img, struct disk_sector_t *s, uint16_t n)
+{
+	bool res;
+
+	n = calc_image_sector(n);
+
+	if (img->map != NULL)
+	{
+		res = (n < img->geo.sectors);
+		if (! res)
+			errno = EINVAL;
+		else
+			memcpy(s, img->map + n * DK_SECTOR_SZ, DK_SECTOR_SZ);
+	}
+	else if (m2d_wcache_get(img, n, s))
+	{
+		// Modified sector not yet written back
+		m2d_count_io(img, false, n, 1, 0);
+		return true;
+	}
+	else
+	{
+		res = (pread(fileno(img->f), s, DK_SECTOR_SZ, 
+			(off_t) n * DK_SECTOR_SZ) == DK_SECTOR_SZ);
+	}
+
+	if (! res)
+		return m2d_fail(img, errno, "read_sector(%d) failed", n);
+
+	m2d_count_io(img, false, n, 1, (img->map == NULL) ? 1 : 0);
+	return true;
+}
+
+
+// m2d_write_sector()
+// Writes sector number n to disk
+//
+bool m2d_write_sector(m2d_image_t *img, struct disk_sector_t *s, uint16_t n)
+{
+	m2d_trace(img, TR_WRITE, n, 1);
+	return write_sector(img, s, n);
+}
+
+
+// m2d_read_sector()
+// Reads sector number n from disk
+//
+bool m2d_read_sector(m2d_image_t *img, struct disk_sector_t *s, uint16_t n)
+{
+	m2d_trace(img, TR_READ, n, 1);
+	return read_sector(img, s, n);
+}
+
+
+// read_runs()
+// Reads the sectors of a request sorted by physical position from
+// the image file. Sectors are grouped into physically contiguous
+// runs (reading over small gaps), and each run is read with a
+// single system call.
+//
+static bool read_runs(m2d_image_t *img, struct sect_ref_t *ref, uint32_t cnt)
+{
+	struct disk_sector_t gap;
+	struct iovec iov[M2D_MAX_IOV];
+	uint32_t i = 0;
+
+	while (i < cnt)
+	{
+		uint16_t start = ref[i].phys;
+		uint16_t next = start;
+		int niov = 0;
+
+		// Collect a run, reading skipped sectors into a scratch buffer
+		while ((i < cnt) && (ref[i].phys >= next)
+			&& (ref[i].phys - next <= M2D_MAX_GAP)
+			&& (niov + (ref[i].phys - next) < M2D_MAX_IOV))
+		{
+			for (; next < ref[i].phys; next ++)
+			{
+				iov[niov].iov_base = &gap;
+				iov[niov ++].iov_len = DK_SECTOR_SZ;
+			}
+			iov[niov].iov_base = ref[i ++].buf;
+			iov[niov ++].iov_len = DK_SECTOR_SZ;
+			next ++;
+		}
+
+		ssize_t len = (ssize_t) niov * DK_SECTOR_SZ;
+		off_t pos = (off_t) start * DK_SECTOR_SZ;
+
+		if (preadv(fileno(img->f), iov, niov, pos) != len)
+			return m2d_fail(img, errno, "read_sector(%d) failed", start);
+
+		m2d_count_io(img, false, start, niov, 1);
+	}
+
+	// Replace sectors modified in the write cache
+	if (img->wcount > 0)
+	{
+		for (uint32_t i = 0; i < cnt; i ++)
+			m2d_wcache_get(img, ref[i].phys, ref[i].buf);
+	}
+	return true;
+}
+
+
+// m2d_read_sectors()
+// Reads cnt consecutive logical sectors starting at n into the
+// array s, in the order of their physical position
+//
+bool m2d_read_sectors(
+	m2d_image_t *img, struct disk_sector_t *s, uint16_t n, uint16_t cnt
+) {
+	if (cnt == 0)
+		return true;
+
+	m2d_trace(img, TR_READ, n, cnt);
+	if (img->map != NULL)
+	{
+		for (uint16_t i = 0; i < cnt; i ++)
+		{
+			if (! read_sector(img, &s[i], n + i))
+				return false;
+		}
+		return true;
+	}
+
+	struct sect_ref_t ref[cnt];
+	for (uint16_t i = 0; i < cnt; i ++)
+	{
+		ref[i].phys = calc_image_sector(n + i);
+		ref[i].buf = &s[i];
+	}
+	sort_sectors(ref, cnt);
+	return read_runs(img, ref, cnt);
+}
+
+
+// m2d_read_scatter()
+// Reads the cnt logical sectors n[i] (in any order) into the
+// buffers s[i]. The image is read in a single forward sweep in
+// the order of the physical sector positions, with one system
+// call per physically contiguous run.
+//
+bool m2d_read_scatter(
+	m2d_image_t *img, const uint16_t *n, struct disk_sector_t **s,
+	uint32_t cnt
+) {
+	if (cnt == 0)
+		return true;
+
+	struct sect_ref_t *ref = malloc(cnt * sizeof(struct sect_ref_t));
+	if (ref == NULL)
+		return m2d_fail(img, errno, "Can't allocate read schedule");
+
+	bool res = true;
+	for (uint32_t i = 0; (i < cnt) && res; i ++)
+	{
+		ref[i].phys = calc_image_sector(n[i]);
+		ref[i].buf = s[i];
+		if (ref[i].phys >= img->geo.sectors)
+			res = m2d_fail(img, EINVAL, "read_sector(%d) failed", ref[i].phys);
+	}
+
+	if (res)
+	{
+		sort_sectors(ref, cnt);
+		for (uint32_t i = 0; i < cnt; i ++)
+			m2d_trace(img, TR_READ, m2d_logical_sector(ref[i].phys), 1);
+
+		if (img->map != NULL)
+		{
+			for (uint32_t i = 0; i < cnt; i ++)
+			{
+				memcpy(ref[i].buf, img->map + ref[i].phys * DK_SECTOR_SZ,
+					DK_SECTOR_SZ);
+				m2d_count_io(img, false, ref[i].phys, 1, 0);
+			}
+		}
+		else
+		{
+			res = read_runs(img, ref, cnt);
+		}
+	}
+	free(ref);
+	return res;
+}
+
+
+// m2d_write_sectors()
+// Writes cnt consecutive logical sectors starting at n from the
+// array s. Without a memory mapping, the sectors go to the write
+// cache, which writes them in physical order when flushed.
+//
+bool m2d_write_sectors(
+	m2d_image_t *img, struct disk_sector_t *s, uint16_t n, uint16_t cnt
+) {
+	if (cnt == 0)
+		return true;
+
+	m2d_trace(img, TR_WRITE, n, cnt);
+	for (uint16_t i = 0; i < cnt; i ++)
+	{
+		if (! write_sector(img, &s[i], n + i))
+			return false;
+	}
+	return true;
+}
+
+
+// m2d_clear_image()
+// Fills the whole image with zero sectors. Regular files are
+// truncated and extended, which leaves a sparse file; a memory
+// mapping is removed while the file is resized.
+//
+bool m2d_clear_image(m2d_image_t *img)
+{
+	struct stat st;
+	int fd = fileno(img->f);
+
+	// Pending writes to the old contents are obsolete
+	m2d_wcache_drop(img);
+
+	if (fstat(fd, &st) != 0)
+		return m2d_fail(img, errno, "Can't access image file");
+
+	if (S_ISREG(st.st_mode))
+	{
+		bool mapped = (img->map != NULL);
+
+		// The old contents needn't be written back
+		if (mapped)
+		{
+			munmap(img->map, img->geo.size);
+			img->map = NULL;
+		}
+
+		m2d_count_io(img, true, 0, 0, 2);
+		if ((ftruncate(fd, 0) != 0)
+			|| (ftruncate(fd, img->geo.size) != 0))
+			return m2d_fail(img, errno, "Can't clear image file");
+
+		if (mapped && (! map_image(img, true)))
+			return m2d_fail(img, errno, "Can't map image file");
+		return true;
+	}
+
+	// Other files get zeros written one cylinder at a time
+	struct disk_sector_t z[N_TRACKS];
+	bzero(z, sizeof(z));
+
+	for (uint16_t i = 0; i < img->geo.sectors; i += N_TRACKS)
+	{
+		if (pwrite(fd, z, sizeof(z), (off_t) i * DK_SECTOR_SZ) 
+			!= sizeof(z))
+			return m2d_fail(img, errno, "Can't clear image file");
+		m2d_count_io(img, true, i, N_TRACKS, 1);
+	}
+	return true;
+}
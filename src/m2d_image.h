@@ -0,0 +1,82 @@
+//=====================================================
+// m2d_image.h
+// Image file I/O backend
+//
+// Lilith Machine Disk Utility
+//
+// Guido Hoss, 25.03.2022
+//
+// Published by Guido Hoss under GNU Public License V3.
+//=====================================================
+
+#ifndef _M2D_IMAGE_H
+#define _M2D_IMAGE_H   1
+
+#include <pthread.h>
+#include "m2d_medos.h"
+#include "m2d_stats.h"
+#include "m2d_wcache.h"
+
+// Number of words in the page map
+#define PAGE_MAP_SZ		((DK_MAX_PAGES + 63) / 64)
+
+// Maximum length of an error message
+#define M2D_MSG_LEN		256
+
+
+// Image handle. Everything known about an opened image lives
+// here, so any number of images can be open at the same time.
+struct m2d_image {
+	FILE *f;					// Image file stream
+	uint8_t *map;				// Memory mapping, or NULL for stdio
+	bool verbose;				// Verbose output enabled
+	m2d_geom_t geo;				// Disk geometry
+	struct m2d_dircache *dir;	// Directory cache, or NULL if not loaded
+	uint64_t page_map[PAGE_MAP_SZ];	// One bit per page (set = used)
+	uint16_t next_page;			// Next-fit allocation cursor
+	bool pagemap_ok;			// Page map is loaded and up to date
+	void (*report)(const char *msg);	// Warning output, or NULL
+	pthread_mutex_t lock;		// Serializes error reporting
+	char msg[M2D_MSG_LEN];		// Text of last error
+	bool collect;				// Statistics enabled
+	m2d_stats_t stats;			// I/O statistics and phase times
+	m2d_phase_t phase;			// Currently timed phase
+	double phase_t0;			// Start time of current phase
+	double open_time;			// Time when image was opened
+	uint16_t last_phys;			// Physical sector after last access
+	FILE *trace;				// Sector access trace, or NULL
+	uint64_t trace_t0;			// Start time of trace
+	pthread_mutex_t trace_lock;	// Serializes trace records
+	uint8_t *wbuf;				// Write cache buffer, or NULL
+	uint64_t wdirty[WCACHE_MAP_SZ];	// One bit per cached sector
+	uint16_t wcount;			// Number of cached sectors
+	bool sync;					// Sync image to storage on write back
+};
+
+
+// Function declarations
+//
+uint16_t calc_image_sector(uint16_t n);
+uint16_t m2d_logical_sector(uint16_t n);
+bool m2d_fail(m2d_image_t *img, int errnum, const char *fmt, ...)
+	__attribute__((format(printf, 3, 4)));
+void m2d_warn(m2d_image_t *img, int errnum, const char *fmt, ...)
+	__attribute__((format(printf, 3, 4)));
+struct disk_sector_t *m2d_map_sector(
+	m2d_image_t *img, struct disk_sector_t *s, uint16_t n
+);
+bool m2d_write_sector(m2d_image_t *img, struct disk_sector_t *s, uint16_t n);
+bool m2d_read_sector(m2d_image_t *img, struct disk_sector_t *s, uint16_t n);
+bool m2d_read_sectors(
+	m2d_image_t *img, struct disk_sector_t *s, uint16_t n, uint16_t cnt
+);
+bool m2d_read_scatter(
+	m2d_image_t *img, const uint16_t *n, struct disk_sector_t **s,
+	uint32_t cnt
+);
+bool m2d_write_sectors(
+	m2d_image_t *img, struct disk_sector_t *s, uint16_t n, uint16_t cnt
+);
+bool m2d_clear_image(m2d_image_t *img);
+
+#endif
@@ -11,111 +11,499 @@
 
 #include <libgen.h>
 #include <string.h>
+#include <pthread.h>
 #include <byteswap.h>
+#include <sys/stat.h>
 #include "m2d_dir.h"
+#include "m2d_dircache.h"
 #include "m2d_pagemap.h"
-#include "m2d_medos.h"
+#include "m2d_image.h"
+#include "m2d_text.h"
 #include "m2d_import.h"
 
 
-// m2d_import()
-// Imports "infile" into the opened Lilith image f.
-// Returns TRUE if successful.
+// Pipeline state of a planned file
+typedef enum {
+	IMP_PENDING,		// Not yet loaded
+	IMP_READY,			// Loaded, ready to commit
+	IMP_FAILED			// Can't be loaded
+} import_state_t;
+
+// Import plan for a single host file
+typedef struct {
+	char *infile;		// Host file name
+	char *bname;		// Lilith file name
+	uint32_t size;		// Host file size in bytes
+	uint16_t pages;		// Number of pages needed
+	bool exists;		// File exists in image (d is valid)
+	dir_entry_t d;		// Directory entry of existing file
+	uint8_t *data;		// File contents once loaded
+	uint32_t len;		// Number of bytes loaded
+	import_state_t state;
+} import_plan_t;
+
+
+// count_sons()
+// Returns the number of son descriptors needed for a file of
+// "pages" pages
 //
-bool m2d_import(FILE *f, char *infile, bool force, bool convert)
+static uint16_t count_sons(uint16_t pages)
 {
-	dir_entry_t d;
-	FILE *infile_fd;
+	return (pages > M2D_PAGETAB_LEN) ? (pages - 1) / M2D_PAGETAB_LEN : 0;
+}
 
-	// Open input file
-	if (((infile_fd = fopen(infile, "r"))) == NULL)
+
+// plan_file()
+// Checks whether "infile" can be imported and determines its
+// directory entry and page demand. Returns FALSE if the file
+// must be skipped.
+//
+static bool plan_file(
+	m2d_image_t *img, char *infile, import_plan_t *p,
+	import_plan_t *plan, uint16_t n, bool force
+) {
+	struct stat st;
+
+	if (stat(infile, &st) != 0)
+	{
+		m2d_warn(img, errno, "Can't open '%s'", infile);
+		return false;
+	}
+	if (! S_ISREG(st.st_mode))
 	{
-		error(0, errno, "Can't open '%s'", infile);
+		m2d_warn(img, 0, "'%s' is not a regular file, ignored", infile);
 		return false;
 	}
 
 	// Establish base name of input file
-	char *bname = basename(infile);
-	VERBOSE("%s... ", bname)
-	
+	p->infile = infile;
+	p->bname = basename(infile);
+	p->size = st.st_size;
+
 	// Check if filename is too long
-	if (strlen(bname) > M2D_EXTNAME_LEN)
+	if (strlen(p->bname) > M2D_EXTNAME_LEN)
 	{
-		error(0, 0, "Filename '%s' too long, ignored", infile);
-		fclose(infile_fd);
+		m2d_warn(img, 0, "Filename '%s' too long, ignored", infile);
 		return false;
 	}
 
+	// The same name may only be imported once per run
+	for (uint16_t j = 0; j < n; j ++)
+	{
+		if (strcmp(plan[j].bname, p->bname) == 0)
+		{
+			m2d_warn(img, 0, "File '%s' specified twice, ignored", infile);
+			return false;
+		}
+	}
+
+	uint32_t pages = (p->size + 8 * DK_SECTOR_SZ - 1) / (8 * DK_SECTOR_SZ);
+	p->pages = (pages > M2D_MAX_PAGES) ? M2D_MAX_PAGES : pages;
+
 	// Search for filename in image file directory
-	if (m2d_lookup_file(f, bname, &d))
+	p->exists = m2d_dir_find(img, p->bname) >= 0;
+	if (p->exists)
 	{
+		if (! m2d_lookup_file(img, p->bname, &p->d))
+		{
+			m2d_warn(img, 0, "Directory entry of '%s' invalid, ignored", 
+				p->bname);
+			return false;
+		}
+
 		// File found; file number in d.filenum
-		if (! (d.reserved || force))
+		if (! (p->d.reserved || force))
 		{
-			error(0, 0, "File '%s' already exists (use -f)", bname);
-			fclose(infile_fd);
+			m2d_warn(img, 0, "File '%s' already exists (use -f)", p->bname);
 			return false;
 		}
 
-		// Deallocate any preexisting pages in directory entry
-		if (! d.reserved)
-			m2d_free_pages(d.page_tab);		
+		// Reserved files must fit into their preallocated pages
+		if (p->d.reserved && (p->pages > p->d.pages))
+		{
+			m2d_warn(img, 0, "File '%s' too large for reserved area", 
+				p->bname);
+			return false;
+		}
+	}
+	return true;
+}
+
+
+// Extra buffer space for files growing between planning and loading
+#define LOAD_SLACK		(8 * DK_SECTOR_SZ)
+
+// load_file()
+// Reads a planned host file into memory and performs the optional
+// text conversion. Called by reader threads; only reports
+// warnings to the image. Returns FALSE if the file can't be read.
+//
+static bool load_file(m2d_image_t *img, import_plan_t *p, bool convert)
+{
+	FILE *infile_fd;
+
+	// Open input file
+	if (((infile_fd = fopen(p->infile, "r"))) == NULL)
+	{
+		m2d_warn(img, errno, "Can't open '%s'", p->infile);
+		return false;
+	}
+
+	// Existing reserved files can only use their preallocated pages
+	uint16_t max_pages = p->exists && p->d.reserved
+		? p->d.pages : M2D_MAX_PAGES;
+	uint32_t max_len = max_pages * 8 * DK_SECTOR_SZ;
+
+	// Size the buffer for the planned size plus a page, rounded up
+	// to whole sectors; it grows if the file has grown since
+	uint32_t sz = ((p->size + LOAD_SLACK) / DK_SECTOR_SZ + 1) * DK_SECTOR_SZ;
+	if (sz > max_len)
+		sz = max_len;
+
+	p->data = malloc(sz);
+	p->len = 0;
+	while (p->data != NULL)
+	{
+		p->len += fread(p->data + p->len, 1, sz - p->len, infile_fd);
+		if ((p->len < sz) || (sz == max_len))
+			break;
+
+		sz = (2 * sz < max_len) ? 2 * sz : max_len;
+		uint8_t *buf = realloc(p->data, sz);
+		if (buf == NULL)
+		{
+			free(p->data);
+			p->data = NULL;
+		}
+		else
+			p->data = buf;
+	}
+
+	if (p->data == NULL)
+	{
+		m2d_warn(img, errno, "Can't allocate buffer for '%s'", p->infile);
+		fclose(infile_fd);
+		return false;
 	}
+	if (ferror(infile_fd))
+	{
+		m2d_warn(img, errno, "Can't read '%s'", p->infile);
+		fclose(infile_fd);
+		return false;
+	}
+	if ((p->len == max_len) && (fgetc(infile_fd) != EOF))
+		m2d_warn(img, 0, "File '%s' truncated (too large)", p->bname);
 
-	// Read file in pages of 8 sectors
-	uint16_t page_n = 0;
-	uint16_t start = 0;
-	uint16_t sect = 0;
-	uint32_t total = 0;
-	uint16_t rd;
-	struct disk_sector_t s;
+	fclose(infile_fd);
 
-	while ((rd = fread(&s, 1, DK_SECTOR_SZ, infile_fd)) > 0)
+	// Optional text conversion
+	if (convert)
 	{
-		total += rd;
-		if ((sect % 8) == 0)
+		m2d_text_convert(p->data, p->len, false);
+		m2d_count_convert(img, p->len);
+	}
+
+	// Clear unused remainder of last sector
+	uint32_t tail = (DK_SECTOR_SZ - p->len % DK_SECTOR_SZ) % DK_SECTOR_SZ;
+	bzero(p->data + p->len, tail);
+
+	return true;
+}
+
+
+// commit_file()
+// Allocates pages for a loaded file, writes its data to the
+// image and registers it in the directory cache. An existing
+// file keeps its pages until the new data has been written, so
+// it is left intact if the import fails. Only called by a single
+// thread. Returns FALSE if the image can't be updated.
+//
+static bool commit_file(m2d_image_t *img, import_plan_t *p)
+{
+	dir_entry_t *d = &p->d;
+
+	if (! p->exists)
+	{
+		// Assign next free file number
+		d->reserved = d->protected = 0;
+		int16_t fnum = m2d_dir_free_filenum(img);
+		if (fnum < 0)
+			return m2d_fail(img, 0, "Directory full");
+		d->filenum = fnum;
+	}
+
+	uint16_t page_n = (p->len + 8 * DK_SECTOR_SZ - 1) / (8 * DK_SECTOR_SZ);
+	uint16_t pages[M2D_MAX_PAGES];
+
+	if (d->reserved)
+	{
+		for (uint16_t j = 0; j < page_n; j ++)
+			pages[j] = bswap_16(d->page_tab[j]) / 13;
+	}
+	else
+	{
+		if (! m2d_alloc_pages(img, page_n, pages))
+			return false;
+
+		for (uint16_t j = 0; j < M2D_PAGETAB_LEN; j ++)
 		{
-			sect = 0;
-			if (d.reserved)
+			d->page_tab[j] = bswap_16((j < page_n) 
+				? pages[j] * 13 : DK_NIL_PAGE);
+		}
+	}
+
+	// Write data in batches of consecutive pages
+	uint16_t j = 0;
+	while (j < page_n)
+	{
+		uint16_t k = j + 1;
+		while ((k < page_n) && (pages[k] == pages[k - 1] + 1))
+			k ++;
+
+		// Only write the used sectors of the last page
+		uint32_t ofs = j * 8 * DK_SECTOR_SZ;
+		uint32_t end = (k == page_n) ? p->len : k * 8 * DK_SECTOR_SZ;
+		uint16_t cnt = (end - ofs + DK_SECTOR_SZ - 1) / DK_SECTOR_SZ;
+
+		if (! m2d_write_sectors(img, 
+			(struct disk_sector_t *) (p->data + ofs), pages[j] * 8, cnt))
+			return false;
+		j = k;
+	}
+
+	// Deallocate the preexisting pages and son descriptors
+	if (p->exists && (! d->reserved) && (! m2d_free_file(img, d->filenum)))
+		return m2d_fail(img, 0, "Can't update directory entry");
+
+	// Register file in directory cache
+	if (! m2d_register_file(
+		img, p->bname, d->filenum, p->len, d->page_tab,
+		d->protected, d->reserved
+	)) {
+		return m2d_fail(img, 0, "Can't create directory entry");
+	}
+
+	// Pages beyond the father's page table go to son descriptors
+	for (uint16_t k = 1; (! d->reserved) && (k <= count_sons(page_n)); k ++)
+	{
+		uint16_t pt[M2D_PAGETAB_LEN];
+		int16_t sfnum = m2d_dir_free_filenum(img);
+
+		if (sfnum < 0)
+			return m2d_fail(img, 0, "Directory full");
+
+		for (uint16_t j = 0; j < M2D_PAGETAB_LEN; j ++)
+		{
+			uint16_t n = k * M2D_PAGETAB_LEN + j;
+			pt[j] = bswap_16((n < page_n) ? pages[n] * 13 : DK_NIL_PAGE);
+		}
+
+		if (! m2d_register_son(img, d->filenum, k, sfnum, pt))
+			return m2d_fail(img, 0, "Can't create son descriptor");
+	}
+	return true;
+}
+
+
+// Import pipeline shared by reader threads and the committer
+typedef struct {
+	m2d_image_t *img;		// Image handle
+	import_plan_t *plan;	// Planned files
+	uint16_t n;				// Number of planned files
+	uint16_t next;			// Next file to be claimed by a reader
+	uint16_t committed;		// Number of files committed so far
+	uint16_t window;		// Max. number of files loaded ahead
+	bool convert;
+	bool abort;				// Committer failed; stop reading
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+} import_pipe_t;
+
+
+// import_reader()
+// Thread procedure: loads planned files into memory, staying
+// at most "window" files ahead of the committer
+//
+static void *import_reader(void *arg)
+{
+	import_pipe_t *pp = arg;
+
+	pthread_mutex_lock(&pp->lock);
+	while ((pp->next < pp->n) && (! pp->abort))
+	{
+		if (pp->next >= pp->committed + pp->window)
+		{
+			pthread_cond_wait(&pp->cond, &pp->lock);
+			continue;
+		}
+
+		import_plan_t *p = &pp->plan[pp->next ++];
+		pthread_mutex_unlock(&pp->lock);
+
+		bool ok = load_file(pp->img, p, pp->convert);
+
+		pthread_mutex_lock(&pp->lock);
+		p->state = ok ? IMP_READY : IMP_FAILED;
+		pthread_cond_broadcast(&pp->cond);
+	}
+	pthread_mutex_unlock(&pp->lock);
+	return NULL;
+}
+
+
+// import_pipeline()
+// Loads the planned files with "jobs" reader threads while the
+// calling thread commits them to the image in plan order.
+// The number of files imported is returned in *count.
+//
+static bool import_pipeline(
+	m2d_image_t *img, import_plan_t *plan, uint16_t n, bool convert, 
+	uint16_t jobs, uint16_t *count
+) {
+	import_pipe_t pp = {
+		.img = img, .plan = plan, .n = n, .window = 2 * jobs,
+		.convert = convert
+	};
+	pthread_t tid[jobs];
+	uint16_t started = 0;
+	bool res = true;
+
+	pthread_mutex_init(&pp.lock, NULL);
+	pthread_cond_init(&pp.cond, NULL);
+
+	// A single job loads the files in the calling thread
+	for (uint16_t i = 0; (jobs > 1) && (i < jobs); i ++)
+	{
+		if (pthread_create(&tid[i], NULL, import_reader, &pp) != 0)
+			break;
+		started ++;
+	}
+
+	for (uint16_t i = 0; (i < n) && res; i ++)
+	{
+		import_plan_t *p = &plan[i];
+
+		if (started == 0)
+		{
+			// No reader threads; load the file ourselves
+			p->state = load_file(img, p, convert) ? IMP_READY : IMP_FAILED;
+		}
+		else
+		{
+			pthread_mutex_lock(&pp.lock);
+			while (p->state == IMP_PENDING)
+				pthread_cond_wait(&pp.cond, &pp.lock);
+			pthread_mutex_unlock(&pp.lock);
+		}
+
+		if (p->state == IMP_READY)
+		{
+			res = commit_file(img, p);
+			if (res)
 			{
-				start = (bswap_16(d.page_tab[page_n ++]) / 13) * 8;
+				VERBOSE(img, "%s... OK\n", p->bname)
+				(*count) ++;
 			}
-			else if (page_n < M2D_PAGETAB_LEN)
+		}
+		free(p->data);
+		p->data = NULL;
+
+		// Let readers proceed beyond this file, or stop them
+		pthread_mutex_lock(&pp.lock);
+		pp.committed ++;
+		pp.abort = ! res;
+		pthread_cond_broadcast(&pp.cond);
+		pthread_mutex_unlock(&pp.lock);
+	}
+
+	for (uint16_t i = 0; i < started; i ++)
+		pthread_join(tid[i], NULL);
+
+	// Discard files read ahead of a failed commit
+	for (uint16_t i = 0; i < n; i ++)
+		free(plan[i].data);
+
+	pthread_mutex_destroy(&pp.lock);
+	pthread_cond_destroy(&pp.cond);
+	return res;
+}
+
+
+// m2d_import()
+// Imports the n host files in "files" into the opened Lilith
+// image. All files are checked and the required space is
+// computed before any data is written. Files are read by "jobs"
+// parallel threads. The number of files imported is returned
+// in *count; files which can't be imported are reported as
+// warnings. Returns FALSE if the import failed.
+//
+bool m2d_import(
+	m2d_image_t *img, char **files, uint16_t n, bool force, bool convert,
+	uint16_t jobs, uint16_t *count
+) {
+	import_plan_t *plan = malloc(n * sizeof(import_plan_t));
+	uint16_t planned = 0;
+	int32_t new_files = 0;
+	int32_t demand = 0;
+	int32_t peak = 0;
+
+	*count = 0;
+	if (plan == NULL)
+		return m2d_fail(img, errno, "Can't plan import");
+
+	// Pass 1: resolve names and compute page demand
+	m2d_phase_t ph = m2d_phase_begin(img, PH_DIRSCAN);
+	for (uint16_t i = 0; i < n; i ++)
+	{
+		import_plan_t *p = &plan[planned];
+
+		if (plan_file(img, files[i], p, plan, planned, force))
+		{
+			if (! p->exists)
 			{
-				start = m2d_find_free_page();
-				d.page_tab[page_n ++] = bswap_16(start * 13);
-				start *= 8;
+				new_files += 1 + count_sons(p->pages);
+				demand += p->pages;
 			}
-			else
+			else if (! p->d.reserved)
 			{
-				error(0, 0, "File truncated (too large)");
-				break;
+				// The old pages are released after the new ones
+				// have been written
+				if (demand + p->pages > peak)
+					peak = demand + p->pages;
+				new_files += count_sons(p->pages) - p->d.nsons;
+				demand += p->pages - p->d.pages;
 			}
+			p->data = NULL;
+			p->state = IMP_PENDING;
+			planned ++;
 		}
-
-		// Optional text conversion
-		if (convert)
-			m2d_text_convert(&s, rd, false);
-
-		// Write sector to image
-		if (m2d_write_sector(f, &s, start + sect))
-			sect ++;
-		else
-			error(1, errno, "Can't write to image");
 	}
+	m2d_phase_end(img, ph);
 
-	// Fill rest of page table
-	for (uint16_t j = page_n; j < M2D_PAGETAB_LEN; j ++)
-		d.page_tab[j] = bswap_16(DK_NIL_PAGE);
+	// Fail before writing anything if the image is too small
+	bool res = true;
+	if (peak > demand)
+		demand = peak;
+	if (new_files > m2d_dir_count_free(img))
+	{
+		res = m2d_fail(img, 0, "Directory full (%d new entries, %d free)",
+			new_files, m2d_dir_count_free(img));
+	}
+	else if (demand > m2d_count_free_pages(img))
+	{
+		res = m2d_fail(img, 0, "Disk image full (%d pages needed, %d free)",
+			demand, m2d_count_free_pages(img));
+	}
 
-	// Register file in directory
-	if (! m2d_register_file(
-		f, bname, d.filenum, total, d.page_tab, d.protected, d.reserved
-	)) {
-		error(0, 0, "Can't create directory entry");
+	// Pass 2: read file data and commit files to image
+	if (res && (planned > 0))
+	{
+		ph = m2d_phase_begin(img, PH_TRANSFER);
+		res = import_pipeline(img, plan, planned, convert,
+			(jobs < planned) ? jobs : planned, count);
+		m2d_phase_end(img, ph);
 	}
 
-	fclose (infile_fd);
-	VERBOSE("OK\n")
-	return true;
-}
\ No newline at end of file
+	free(plan);
+	return res;
+}
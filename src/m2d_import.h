@@ -17,6 +17,9 @@
 
 // Forward declarations
 //
-bool m2d_import(FILE *f, char *infile, bool force, bool convert);
+bool m2d_import(
+	m2d_image_t *img, char **files, uint16_t n, bool force, bool convert,
+	uint16_t jobs, uint16_t *count
+);
 
 #endif
\ No newline at end of file
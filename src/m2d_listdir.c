@@ -15,13 +15,14 @@
 
 
 // m2d_list_dir()
-// List filesystem directory with optional wildcard filter
+// List filesystem directory, optionally filtered by selection sel
 //
-void m2d_list_dir(FILE *f, char *filearg)
+bool m2d_list_dir(m2d_image_t *img, const m2d_select_t *sel)
 {
 	// Callback to print a directory entry
-	bool print_dir(dir_entry_t *d)
+	bool print_dir(dir_entry_t *d, void *ctx)
 	{
+		(void) ctx;
 		printf(
 			"%c%c %-26.26s%4d%9d  ",
 			(d->reserved != 0) ? '*' : ' ',
@@ -38,23 +39,43 @@ void m2d_list_dir(FILE *f, char *filearg)
 	};
 
 	// Traverse the directory tree starting at its root
-	m2d_traverse(f, filearg, print_dir);
+	return m2d_traverse(img, sel, DE_NAME | DE_INFO, print_dir, NULL);
+}
+
+
+// m2d_list_names()
+// List only the names of the files selected by sel, which
+// doesn't require the file directory
+//
+bool m2d_list_names(m2d_image_t *img, const m2d_select_t *sel)
+{
+	bool print_name(dir_entry_t *d, void *ctx)
+	{
+		(void) ctx;
+		printf("%s\n", d->name);
+		return true;
+	};
+
+	return m2d_traverse(img, sel, DE_NAME, print_name, NULL);
 }
 
 
 // m2d_list_pagetab()
-// List page table of specified file(s)
+// List page table of the files selected by sel
 //
-void m2d_list_pagetab(FILE *f, char *filearg)
+bool m2d_list_pagetab(m2d_image_t *img, const m2d_select_t *sel)
 {
-	bool print_pagetab(dir_entry_t *d)
+	// The image is passed as context; a capturing callback would
+	// need an executable stack
+	bool print_pagetab(dir_entry_t *d, void *ctx)
 	{
+		m2d_image_t *img = ctx;
 		uint16_t i;
 
 		printf("%s:", d->name);
-		for (i = 0; i < M2D_PAGETAB_LEN; i ++)
+		for (i = 0; i < M2D_MAX_PAGES; i ++)
 		{
-			uint16_t pg = bswap_16(d->page_tab[i]);
+			uint16_t pg = m2d_file_page(img, d, i);
 			if (pg == DK_NIL_PAGE)
 				break;
 
@@ -68,5 +89,5 @@ void m2d_list_pagetab(FILE *f, char *filearg)
 	};
 
 	// Traverse the directory tree starting at its root
-	m2d_traverse(f, filearg, print_pagetab);
+	return m2d_traverse(img, sel, DE_ALL, print_pagetab, img);
 }
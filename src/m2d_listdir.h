@@ -13,11 +13,13 @@
 #define _M2D_LISTDIR_H   1
 
 #include "m2disk.h"
+#include "m2d_select.h"
 
 
 // Forward declarations
 //
-void m2d_list_dir(FILE *f, char *filearg);
-void m2d_list_pagetab(FILE *f, char *filearg);
+bool m2d_list_dir(m2d_image_t *img, const m2d_select_t *sel);
+bool m2d_list_names(m2d_image_t *img, const m2d_select_t *sel);
+bool m2d_list_pagetab(m2d_image_t *img, const m2d_select_t *sel);
 
 #endif
\ No newline at end of file
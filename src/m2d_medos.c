@@ -11,7 +11,9 @@
 
 #include <string.h>
 #include <byteswap.h>
-#include "m2d_medos.h"
+#include "m2d_image.h"
+#include "m2d_dircache.h"
+#include "m2d_pagemap.h"
 
 
 // Reserved file entries
@@ -24,184 +26,103 @@ struct reserved_file_t {
 	bool readonly;		// "Protected" flag
 };
 
-const struct reserved_file_t reserved_file[DK_NUM_RESFILES] = 
-{
-	{ "FS.FileDirectory",		DK_DIR_START,	DK_NUM_FILES,	false },
-	{ "FS.FileDirectory.Back",	36768,			DK_NUM_FILES,	false },
-	{ "FS.NameDirectory",		DK_NAME_START, 	DK_NAMEDIR_LEN,	false },
-	{ "FS.NameDirectory.Back",	37536,			DK_NAMEDIR_LEN,	false },
-	{ "FS.BadPages",			0,				0,				false },
-	{ "PC.BootFile",			0,				192,			true },
-	{ "PC.BootFile.Back",		1248,			192,			true },
-	{ "PC.DumpFile",			192,			512,			true },
-	{ "PC.Dump1File",			704,			512 ,			true }
-};
 
-
-// text_convert()
-// Converts all line endings in the given sector
+// m2d_init_geom()
+// Sets up geometry g for a disk with the specified number of
+// cylinders. The standard disk has DK_NUM_CYLS cylinders.
+// Returns FALSE if the number of cylinders is not supported.
 //
-#define M2_EOL	'\036'
-#define UX_EOL	'\n'
-#define UX_TAB	'\t'
-
-void m2d_text_convert(struct disk_sector_t *s, uint16_t n, bool to_unix)
+bool m2d_init_geom(m2d_geom_t *g, uint16_t cyls)
 {
-	uint8_t *p = s->type.b;
-
-	for (uint16_t i = 0; i < n; i ++, p ++)
-	{
-		switch (*p)
-		{
-			case M2_EOL :
-				if (to_unix) *p = UX_EOL;
-				break;
+	// The page numbered DK_NIL_PAGE / 13 can't be referenced, so
+	// it must not lie in the directory backups at the end of the disk
+	uint16_t nil_cyl = (DK_NIL_PAGE / 13) * 8 / N_TRACKS;
 
-			case UX_EOL :
-				if (! to_unix) *p = M2_EOL;
-				break;
-			
-			case UX_TAB :
-				if (! to_unix) *p = ' ';
-				break;
+	if ((cyls < DK_MIN_CYLS) || (cyls > DK_MAX_CYLS)
+		|| ((cyls > nil_cyl) && (cyls - 9 <= nil_cyl)))
+		return false;
 
-			default :
-				break;
-		}
-	}
+	g->cyls = cyls;
+	g->sectors = cyls * N_TRACKS;
+	g->pages = g->sectors / 8;
+	g->dir_start = (cyls / 2 - 8) * N_TRACKS;
+	g->name_start = (cyls / 2) * N_TRACKS;
+	g->dir_back = (cyls - 9) * N_TRACKS;
+	g->name_back = (cyls - 1) * N_TRACKS;
+	g->size = (size_t) g->sectors * DK_SECTOR_SZ;
+	return true;
 }
 
 
-// calc_image_sector()
-// Calculate the actual disk sector in the image from a
-// given logical (sequential) sector number
+// init_disk_space()
+// Creates the sectors for an empty disk
 //
-#define N_TRACKS	96
-#define N_SECTORS	48
-#define N_HEADS		2
-
-uint16_t calc_image_sector(uint16_t n)
+bool init_disk_space(m2d_image_t *img)
 {
-	uint16_t c, h, s;	// Cylinder, head, sector
-
-	c = n / N_TRACKS;
-	h = (n / N_SECTORS ) % N_HEADS;
-	s = (n % N_SECTORS) * ((c < 15) ? 3 : 12);
-	s = (s % N_SECTORS) + (s / N_SECTORS);
+	if (! m2d_clear_image(img))
+		return false;
 
-	return (c * N_TRACKS) + (h * N_SECTORS) + s;   
+	VERBOSE(img, "Created empty image file: OK\n")
+	return true;
 }
 
 
-// m2d_write_sector()
-// Writes sector number n to disk
+// clear_filedir_entry()
+// Marks file descriptor fdp of file number fnum as unused
 //
-bool m2d_write_sector(FILE *f, struct disk_sector_t *s, uint16_t n)
+static void clear_filedir_entry(struct file_desc_t *fdp, uint16_t fnum)
 {
-	n = calc_image_sector(n);
-
-	bool res = (fseek(f, n * DK_SECTOR_SZ, SEEK_SET) != -1)
-		&& (fwrite(s, DK_SECTOR_SZ, 1, f) == 1);
-
-	if (! res)
-		error(0, errno, "write_sector(%d) failed", n);
-	return res;
-}
-
+	fdp->reserved = 0;
+	fdp->file_num = bswap_16(fnum);
+	fdp->version = UINT16_MAX;
+	fdp->fd_kind = bswap_16(FDK_NOFILE);
 
-// m2d_read_sector()
-// Reads sector number n from disk
-//
-bool m2d_read_sector(FILE *f, struct disk_sector_t *s, uint16_t n)
-{
-	n = calc_image_sector(n);
-	
-	bool res = (fseek(f, n * DK_SECTOR_SZ, SEEK_SET) != -1)
-		&& (fread(s, DK_SECTOR_SZ, 1, f) == 1);
-		
-	if (! res)
-		error(0, errno, "read_sector(%d) failed", n);
-	return res;
+	// Initialize page table
+	for (uint16_t j = 0; j < M2D_PAGETAB_LEN; j ++)
+		fdp->page_tab[j] = bswap_16(DK_NIL_PAGE);
 }
 
 
-// init_disk_space()
-// Creates the sectors for an empty disk
+// clear_namedir_entry()
+// Marks name descriptor ndp as unused
 //
-bool init_disk_space(FILE *f)
+static void clear_namedir_entry(struct name_desc_t *ndp)
 {
-	struct disk_sector_t s;
-
-	// Create a zero sector and fill the disk with it
-	bzero(&s, DK_SECTOR_SZ);
-	for (uint16_t i = 0; i < DK_NUM_SECTORS; i ++)
-	{
-		if (! m2d_write_sector(f, &s, i))
-			return false;
-	}
-	VERBOSE("Created empty image file: OK\n")
-	return true;
+	memset(ndp->en, ' ', M2D_EXTNAME_LEN);
+	ndp->nd_kind = bswap_16(NDK_FREE);
+	ndp->file_num = 0;
+	ndp->version = 0;
+	ndp->fres = 0;
 }
 
 
 // init_file_dir()
-// Initializes an empty file directory
+// Initializes an empty file directory in the directory cache
 //
-bool init_file_dir(FILE *f)
+bool init_file_dir(m2d_image_t *img)
 {
-	struct disk_sector_t s;
-
-	// Make template for an empty file directory sector
-	struct file_desc_t *fdp = &s.type.fd;
-	fdp->reserved = 0;
-	fdp->version = UINT16_MAX;
-	fdp->fd_kind = bswap_16(FDK_NOFILE);
-
-	// Initialize filler area
-	bzero(fdp->fdk.filler, M2D_MAX_FILLER + 1);
-
-	// Initialize page table
-	for (uint16_t i = 0; i < M2D_PAGETAB_LEN; i ++)
-		fdp->page_tab[i] = bswap_16(DK_NIL_PAGE);
-
-	// Write empty file directory to disk
 	for (uint16_t i = 0; i < DK_NUM_FILES; i ++)
 	{
-		fdp->file_num = bswap_16(i);
-		if (! m2d_write_sector(f, &s, DK_DIR_START + i))
-			return false;
+		// Filler area is already zero in the new directory
+		clear_filedir_entry(m2d_dir_filedesc(img, i), i);
+		m2d_dir_touch_filedesc(img, i);
 	}
-	VERBOSE("Created empty file directory: OK\n")
+	VERBOSE(img, "Created empty file directory: OK\n")
 	return true;
 }
 
 
 // init_name_dir()
-// Initializes an empty name directory
+// Initializes an empty name directory in the directory cache
 //
-bool init_name_dir(FILE *f)
+bool init_name_dir(m2d_image_t *img)
 {
-	struct disk_sector_t s;
-
-	// Make template for an empty name directory sector
-	for (uint16_t i = 0; i < DK_NUM_ND_SECT; i ++)
-	{
-		struct name_desc_t *ndp = &(s.type.nd[i]);
-
-		memset(ndp->en, ' ', M2D_EXTNAME_LEN);
-		ndp->nd_kind = bswap_16(NDK_FREE);
-		ndp->file_num = 0;
-		ndp->version = 0;
-		ndp->fres = 0;
-	}
-
-	// Write empty name directory to disk
-	for (uint16_t i = 0; i < DK_NAMEDIR_LEN; i ++)
+	for (uint16_t i = 0; i < DK_NUM_FILES; i ++)
 	{
-		if (! m2d_write_sector(f, &s, DK_NAME_START + i))
-			return false;
+		clear_namedir_entry(m2d_dir_namedesc(img, i));
+		m2d_dir_touch_namedesc(img, i);
 	}
-	VERBOSE("Created empty name directory: OK\n")
+	VERBOSE(img, "Created empty name directory: OK\n")
 	return true;
 }
 
@@ -210,17 +131,14 @@ bool init_name_dir(FILE *f)
 // Makes a new file directory entry for the specified file
 //
 bool make_filedir_entry(
-	FILE *f,
+	m2d_image_t *img,
 	uint16_t fnum, uint32_t sz, 
 	uint16_t *pt, bool readonly, bool reserved
 ) {
-	struct disk_sector_t s;
-
-	uint16_t sn = DK_DIR_START + fnum;
-	if (! m2d_read_sector(f, &s, sn))
+	struct file_desc_t *fdp = m2d_dir_filedesc(img, fnum);
+	if (fdp == NULL)
 		return false;
 
-	struct file_desc_t *fdp = &s.type.fd;
 	fdp->fd_kind = bswap_16(FDK_FATHER);
 	fdp->file_num = bswap_16(fnum);
 	fdp->version = UINT16_MAX;
@@ -247,10 +165,8 @@ bool make_filedir_entry(
 	for (uint16_t j = 0; j < M2D_MAX_SONS - 1; j ++)
 		fa->sontab[j] = bswap_16(DK_NIL_PAGE);
 
-	// Write directory entry to disk
-	if (! m2d_write_sector(f, &s, sn))
-		return false;
-
+	// Directory entry is written to disk when the cache is flushed
+	m2d_dir_touch_filedesc(img, fnum);
 	return true;
 }
 
@@ -258,40 +174,19 @@ bool make_filedir_entry(
 // make_namedir_entry()
 // Makes a new name director entry for the specified file
 //
-bool make_namedir_entry(FILE *f, char *fname, uint16_t fnum)
+bool make_namedir_entry(m2d_image_t *img, char *fname, uint16_t fnum)
 {
-	// Convert null-terminated string to space-padded string
-	void convert_filename(char *m2f, char *uxf)
-	{
-		bool space = false;
-
-		for (uint16_t i = 0; i < M2D_EXTNAME_LEN; i ++)
-		{
-			if (*uxf == '\0')
-				space = true;
-			*m2f = space ? ' ' : *uxf;
-			m2f ++;
-			uxf ++;
-		}
-	}
-
-	struct disk_sector_t s;
-
-	uint16_t nsn = DK_NAME_START + (fnum / DK_NUM_ND_SECT);
-	if (! m2d_read_sector(f, &s, nsn))
+	struct name_desc_t *ndp = m2d_dir_namedesc(img, fnum);
+	if (ndp == NULL)
 		return false;
 
-	struct name_desc_t *ndp = &s.type.nd[fnum % DK_NUM_ND_SECT];
-
-	convert_filename(&(ndp->en[0]), fname);
+	m2d_pad_name(&(ndp->en[0]), fname);
 	ndp->nd_kind = bswap_16(NDK_FNAME);
 	ndp->file_num = bswap_16(fnum);
 	ndp->version = UINT16_MAX;
 
-	// Write name directory entry to disk
-	if (! m2d_write_sector(f, &s, nsn))
-		return false;
-
+	// Name directory entry is written when the cache is flushed
+	m2d_dir_touch_namedesc(img, fnum);
 	return true;
 }
 
@@ -301,20 +196,122 @@ bool make_namedir_entry(FILE *f, char *fname, uint16_t fnum)
 // directories
 //
 bool m2d_register_file(
-	FILE *f, char *fname,
+	m2d_image_t *img, char *fname,
 	uint16_t fnum, uint32_t sz, 
 	uint16_t *pt, bool readonly, bool reserved
 ) {
-	return make_filedir_entry(f, fnum, sz, pt, readonly, reserved)
-		&& make_namedir_entry(f, fname, fnum);
+	return make_filedir_entry(img, fnum, sz, pt, readonly, reserved)
+		&& make_namedir_entry(img, fname, fnum);
+}
+
+
+// m2d_register_son()
+// Creates son descriptor number "son" (1..M2D_MAX_SONS-1) with
+// file number sfnum and page table pt for the registered file fnum
+//
+bool m2d_register_son(
+	m2d_image_t *img, uint16_t fnum, uint16_t son, uint16_t sfnum, 
+	uint16_t *pt
+) {
+	struct file_desc_t *fa = m2d_dir_filedesc(img, fnum);
+	struct file_desc_t *fdp = m2d_dir_filedesc(img, sfnum);
+
+	if ((fa == NULL) || (fdp == NULL) || (son == 0) || (son >= M2D_MAX_SONS))
+		return false;
+
+	bzero(fdp, sizeof(struct file_desc_t));
+	fdp->fd_kind = bswap_16(FDK_SON);
+	fdp->file_num = bswap_16(sfnum);
+	fdp->version = UINT16_MAX;
+	fdp->fdk.son.father_num = bswap_16(fnum);
+	fdp->fdk.son.father_vers = fa->version;
+	fdp->fdk.son.son_num = bswap_16(son);
+	memcpy(fdp->page_tab, pt, M2D_PAGETAB_LEN * sizeof(uint16_t));
+
+	// Link son to its father
+	fa->fdk.father.sontab[son - 1] = bswap_16(sfnum);
+
+	m2d_dir_touch_filedesc(img, sfnum);
+	m2d_dir_touch_filedesc(img, fnum);
+	return true;
+}
+
+
+// m2d_free_file()
+// Releases all pages of file number fnum, including those of its
+// son descriptors, and removes the son descriptors
+//
+bool m2d_free_file(m2d_image_t *img, uint16_t fnum)
+{
+	struct file_desc_t *fdp = m2d_dir_filedesc(img, fnum);
+
+	if (fdp == NULL)
+		return false;
+
+	for (uint16_t j = 0; j < M2D_MAX_SONS - 1; j ++)
+	{
+		uint16_t sfnum = bswap_16(fdp->fdk.father.sontab[j]);
+		struct file_desc_t *sfdp = m2d_dir_filedesc(img, sfnum);
+
+		if ((sfdp != NULL) && (sfdp->fd_kind == bswap_16(FDK_SON))
+			&& (bswap_16(sfdp->fdk.son.father_num) == fnum))
+		{
+			m2d_free_pages(img, sfdp->page_tab);
+			bzero(&sfdp->fdk, sizeof(sfdp->fdk));
+			clear_filedir_entry(sfdp, sfnum);
+			m2d_dir_touch_filedesc(img, sfnum);
+		}
+		fdp->fdk.father.sontab[j] = bswap_16(DK_NIL_PAGE);
+	}
+
+	m2d_free_pages(img, fdp->page_tab);
+	m2d_dir_touch_filedesc(img, fnum);
+	return true;
+}
+
+
+// m2d_unregister_file()
+// Removes the file and name directory entries of file number
+// fnum. Its pages must have been released by the caller.
+//
+bool m2d_unregister_file(m2d_image_t *img, uint16_t fnum)
+{
+	struct file_desc_t *fdp = m2d_dir_filedesc(img, fnum);
+	struct name_desc_t *ndp = m2d_dir_namedesc(img, fnum);
+
+	if ((fdp == NULL) || (ndp == NULL))
+		return false;
+
+	bzero(&fdp->fdk, sizeof(fdp->fdk));
+	clear_filedir_entry(fdp, fnum);
+	clear_namedir_entry(ndp);
+
+	// Entries are written to disk when the cache is flushed
+	m2d_dir_touch_filedesc(img, fnum);
+	m2d_dir_touch_namedesc(img, fnum);
+	return true;
 }
 
 
 // init_reserved_files()
 // Initialize the reserved file entries
 //
-bool init_reserved_files(FILE *f)
+bool init_reserved_files(m2d_image_t *img)
 {
+	const m2d_geom_t *g = &img->geo;
+	const struct reserved_file_t reserved_file[DK_NUM_RESFILES] = 
+	{
+		{ "FS.FileDirectory",		g->dir_start,	DK_NUM_FILES,	false },
+		{ "FS.FileDirectory.Back",	g->dir_back,	DK_NUM_FILES,	false },
+		{ "FS.NameDirectory",		g->name_start, 	DK_NAMEDIR_LEN,	false },
+		{ "FS.NameDirectory.Back",	g->name_back,	DK_NAMEDIR_LEN,	false },
+		{ "FS.BadPages",			0,				0,				false },
+		{ "PC.BootFile",			0,				192,			true },
+		{ "PC.BootFile.Back",		1248,			192,			true },
+		{ "PC.DumpFile",			192,			512,			true },
+		{ "PC.Dump1File",			704,			512 ,			true }
+	};
+
 	// Part 1: Make directory entry
 	for (uint16_t i = 0; i < DK_NUM_RESFILES; i ++)
 	{
@@ -331,7 +328,7 @@ bool init_reserved_files(FILE *f)
 		}
 
 		bool res = m2d_register_file(
-			f, fp->en, i, fp->sectors * DK_SECTOR_SZ, 
+			img, fp->en, i, fp->sectors * DK_SECTOR_SZ, 
 			pt, fp->readonly, true);
 			
 		if (! res) 
@@ -343,12 +340,21 @@ bool init_reserved_files(FILE *f)
 
 // init_image_file()
 // Creates an empty image file with an initialized directory and
-// the standard default files.
+// the standard default files. The directory is built in memory
+// and written in one pass.
 //
-bool m2d_init_image(FILE *f)
+bool m2d_init_image(m2d_image_t *img)
 {
-	return init_disk_space(f)
-		&& init_file_dir(f)
-		&& init_name_dir(f)
-		&& init_reserved_files(f);
+	m2d_phase_t ph = m2d_phase_begin(img, PH_TRANSFER);
+	bool res = init_disk_space(img);
+
+	// The page map of the old contents is no longer valid
+	img->pagemap_ok = false;
+	m2d_phase_end(img, ph);
+	return res
+		&& m2d_dircache_create(img)
+		&& init_file_dir(img)
+		&& init_name_dir(img)
+		&& init_reserved_files(img)
+		&& m2d_dircache_flush(img);
 }
\ No newline at end of file
@@ -22,6 +22,7 @@
 #define M2D_MAX_SONS		16
 #define M2D_PAGETAB_LEN		96
 #define M2D_EXTNAME_LEN		24
+#define M2D_MAX_PAGES		(M2D_MAX_SONS * M2D_PAGETAB_LEN)
 
 // Position
 struct file_pos_t {
@@ -75,12 +76,38 @@ struct name_desc_t {
 };
 
 // Disk dimensions
-#define DK_NUM_SECTORS	37632	// Total number of sectors on disk
+#define DK_NUM_SECTORS	37632	// Number of sectors on a standard disk
 #define DK_SECTOR_SZ	256		// Size of a sector in bytes
-#define DK_NUM_PAGES	(DK_NUM_SECTORS / 8)
 #define DK_NUM_FILES	768		// Max. number of files on disk
 #define DK_NUM_ND_SECT	(DK_SECTOR_SZ / sizeof(struct name_desc_t))
 #define DK_NIL_PAGE		61152	// Value of the NIL page pointer
+#define DK_IMAGE_SZ		((size_t) DK_NUM_SECTORS * DK_SECTOR_SZ)
+
+// Disk geometry
+#define N_TRACKS	96		// Sectors per cylinder
+#define N_SECTORS	48		// Sectors per track
+#define N_HEADS		2		// Tracks per cylinder
+
+// Supported number of cylinders. Page pointers (page * 13) must
+// fit into 16 bits, and the directory must lie beyond the boot files.
+#define DK_NUM_CYLS		(DK_NUM_SECTORS / N_TRACKS)
+#define DK_MIN_CYLS		48
+#define DK_MAX_CYLS		420
+#define DK_MAX_SECTORS	(DK_MAX_CYLS * N_TRACKS)
+#define DK_MAX_PAGES	(DK_MAX_SECTORS / 8)
+
+// Geometry of an image. The file directory and its backup are
+// placed relative to the number of cylinders as on a standard disk.
+typedef struct {
+	uint16_t cyls;			// Number of cylinders
+	uint16_t sectors;		// Number of sectors
+	uint16_t pages;			// Number of pages
+	uint16_t dir_start;		// 1st file directory sector
+	uint16_t dir_back;		// 1st file directory backup sector
+	uint16_t name_start;	// 1st name directory sector
+	uint16_t name_back;		// 1st name directory backup sector
+	size_t size;			// Size of image in bytes
+} m2d_geom_t;
 
 // Disk sector
 struct disk_sector_t {
@@ -92,22 +119,24 @@ struct disk_sector_t {
 };
 
 // Special file locations
-#define DK_DIR_START	18048	// 1st file directory sector
-#define DK_NAME_START	18816	// 1st name directory sector
 #define DK_NAMEDIR_LEN	(DK_NUM_FILES / DK_NUM_ND_SECT)
 #define DK_PAGE_START	0		// First available free page
 
 
 // Function declarations
 //
-void m2d_text_convert(struct disk_sector_t *s, uint16_t n, bool to_unix);
-bool m2d_init_image(FILE *f);
-bool m2d_write_sector(FILE *f, struct disk_sector_t *s, uint16_t n);
-bool m2d_read_sector(FILE *f, struct disk_sector_t *s, uint16_t n);
+bool m2d_init_geom(m2d_geom_t *g, uint16_t cyls);
+bool m2d_init_image(m2d_image_t *img);
 bool m2d_register_file(
-	FILE *f, char *fname,
+	m2d_image_t *img, char *fname,
 	uint16_t fnum, uint32_t sz, 
 	uint16_t *pt, bool readonly, bool reserved
 );
+bool m2d_unregister_file(m2d_image_t *img, uint16_t fnum);
+bool m2d_register_son(
+	m2d_image_t *img, uint16_t fnum, uint16_t son, uint16_t sfnum, 
+	uint16_t *pt
+);
+bool m2d_free_file(m2d_image_t *img, uint16_t fnum);
 
 #endif
\ No newline at end of file
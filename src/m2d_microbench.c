@@ -0,0 +1,252 @@
+//=====================================================
+// m2d_microbench.c
+// Micro-benchmarks of the inner library kernels
+//
+// Lilith Machine Disk Utility
+//
+// Guido Hoss, 25.03.2022
+//
+// Published by Guido Hoss under GNU Public License V3.
+//=====================================================
+
+#include <string.h>
+#include <limits.h>
+#include <math.h>
+#include "libm2disk.h"
+#include "m2d_image.h"
+#include "m2d_text.h"
+
+
+// Default number of samples per kernel
+#define MB_SAMPLES		20
+
+// Size of the text conversion buffer
+#define MB_TEXT_SZ		(64 * 1024)
+
+// Results are accumulated here so the kernels can't be optimized away
+static volatile uint32_t sink;
+static uint16_t samples = MB_SAMPLES;
+
+// Test data shared by the kernels
+static const char *names[] = {
+	"PC.BootFile", "FS.NameDirectory.Back", "A", "SYSTEM.OBJ",
+	"Storage.SYM", "ABCDEFGHIJKLMNOPQRSTUVWX"
+};
+#define N_NAMES		(sizeof(names) / sizeof(char *))
+
+static char padded[N_NAMES][M2D_EXTNAME_LEN];
+static m2d_image_t *img;
+static uint8_t *text;
+static m2d_select_t *sel;
+
+
+// run()
+// Runs "kernel" for a number of samples of "iters" iterations each
+// and prints the mean time per iteration, its standard deviation
+// and the fastest sample. The kernel returns the time taken if it
+// measures only part of its work itself, or a negative value.
+//
+static void run(char *name, uint32_t iters, double (*kernel)(uint32_t))
+{
+	double sum = 0, sum2 = 0, best = 1e30;
+
+	// Warm up caches and lookup tables
+	kernel(iters);
+
+	for (uint16_t s = 0; s < samples; s ++)
+	{
+		double t = m2d_now();
+		double k = kernel(iters);
+
+		t = ((k >= 0) ? k : m2d_now() - t) * 1e9 / iters;
+		sum += t;
+		sum2 += t * t;
+		if (t < best)
+			best = t;
+	}
+
+	double mean = sum / samples;
+	double var = (sum2 / samples) - (mean * mean);
+	printf("%-22s %10.2f %10.2f %10.2f\n", name, mean,
+		sqrt((var > 0) ? var : 0), best);
+}
+
+
+// sector_map()
+// Interleave translation of all logical sectors
+//
+static double sector_map(uint32_t iters)
+{
+	uint32_t x = 0;
+
+	for (uint32_t i = 0; i < iters; i ++)
+		x += calc_image_sector(i % DK_NUM_SECTORS);
+	sink = x;
+	return -1;
+}
+
+
+// text_to_unix(), text_to_m2()
+// Text conversion of a buffer of Modula-2 source text
+//
+static double text_to_unix(uint32_t iters)
+{
+	for (uint32_t i = 0; i < iters; i ++)
+		m2d_text_convert(text, MB_TEXT_SZ, true);
+	sink = text[0];
+	return -1;
+}
+
+static double text_to_m2(uint32_t iters)
+{
+	for (uint32_t i = 0; i < iters; i ++)
+		m2d_text_convert(text, MB_TEXT_SZ, false);
+	sink = text[0];
+	return -1;
+}
+
+
+// find_free_page()
+// Page allocation in a fragmented page map (every 3rd page
+// used); only the allocations are timed
+//
+static double find_free_page(uint32_t iters)
+{
+	double t = 0;
+	uint32_t done = 0;
+
+	while (done < iters)
+	{
+		m2d_load_pagemap(img);
+		for (uint16_t i = 0; i < img->geo.pages; i += 3)
+			m2d_set_page(img, i, true);
+
+		double t0 = m2d_now();
+		uint16_t n = 0;
+
+		while ((done < iters)
+			&& (m2d_find_free_page(img) < img->geo.pages))
+		{
+			done ++;
+			n ++;
+		}
+		t += m2d_now() - t0;
+
+		// Stop if the page map is unexpectedly full
+		if (n == 0)
+			error(1, 0, "%s", m2d_error(img));
+	}
+	return t;
+}
+
+
+// pad_name(), unpad_name()
+// Name padding and unpadding
+//
+static double pad_name(uint32_t iters)
+{
+	char en[M2D_EXTNAME_LEN];
+
+	for (uint32_t i = 0; i < iters; i ++)
+	{
+		m2d_pad_name(en, names[i % N_NAMES]);
+		sink = en[M2D_EXTNAME_LEN - 1];
+	}
+	return -1;
+}
+
+static double unpad_name(uint32_t iters)
+{
+	char name[M2D_EXTNAME_LEN + 1];
+
+	for (uint32_t i = 0; i < iters; i ++)
+	{
+		m2d_unpad_name(name, padded[i % N_NAMES]);
+		sink = name[0];
+	}
+	return -1;
+}
+
+
+// select_match()
+// File selection by a mix of suffix, literal and glob patterns
+//
+static double select_match(uint32_t iters)
+{
+	uint32_t x = 0;
+
+	for (uint32_t i = 0; i < iters; i ++)
+		x += m2d_select_match(sel, names[i % N_NAMES]);
+	sink = x;
+	return -1;
+}
+
+
+int main(int argc, char **argv)
+{
+	char c;
+
+	while ((c = getopt(argc, argv, "n:")) != -1)
+	{
+		switch (c)
+		{
+			case 'n' :
+				samples = atoi(optarg);
+				if (samples < 1)
+					error(1, 0, "Number of samples must be positive");
+				break;
+
+			default :
+				error(1, 0, "USAGE: m2d_microbench [-n samples]");
+				break;
+		}
+	}
+
+	// Page map kernels need an image handle
+	char img_name[PATH_MAX];
+	char *tmp = getenv("TMPDIR");
+	snprintf(img_name, PATH_MAX, "%s/m2d_microbench.%d.img",
+		tmp ? tmp : "/tmp", getpid());
+
+	img = m2d_open(img_name, M2D_CREATE | M2D_FORCE);
+	if ((img == NULL) || (! m2d_init_image(img)))
+		error(1, errno, "Can't create image '%s'", img_name);
+
+	text = malloc(MB_TEXT_SZ);
+	if (text == NULL)
+		error(1, errno, "Can't allocate text buffer");
+	for (uint32_t i = 0; i < MB_TEXT_SZ; i ++)
+		text[i] = (i % 41 == 40) ? '\n' : 'A' + (i % 26);
+
+	for (uint16_t i = 0; i < N_NAMES; i ++)
+		m2d_pad_name(padded[i], names[i]);
+
+	sel = m2d_select_new();
+	char lit[16];
+	bool ok = (sel != NULL) && m2d_select_add(sel, "*.DEF", false)
+		&& m2d_select_add(sel, "*.MOD", false)
+		&& m2d_select_add(sel, "Stor?ge.*", false)
+		&& m2d_select_add(sel, "Test*", true);
+	for (uint16_t i = 0; ok && (i < 100); i ++)
+	{
+		snprintf(lit, sizeof(lit), "FILE%02d.OBJ", i);
+		ok = m2d_select_add(sel, lit, false);
+	}
+	if (! ok)
+		error(1, errno, "Can't compile selection");
+
+	printf("%-22s %10s %10s %10s\n", "kernel", "ns/op", "stddev", "min");
+	run("calc_image_sector", 1000000, sector_map);
+	run("text_convert_64k_unix", 200, text_to_unix);
+	run("text_convert_64k_m2", 200, text_to_m2);
+	run("find_free_page", 10000, find_free_page);
+	run("pad_name", 1000000, pad_name);
+	run("unpad_name", 1000000, unpad_name);
+	run("select_match", 1000000, select_match);
+
+	m2d_select_free(sel);
+	free(text);
+	m2d_close(img);
+	unlink(img_name);
+	return 0;
+}
@@ -1,5 +1,5 @@
 //=====================================================
-// m2d_pagemap.h
+// m2d_pagemap.c
 // Disk pagemap table
 //
 // Lilith Machine Disk Utility
@@ -10,63 +10,260 @@
 //=====================================================
 
 #include <byteswap.h>
-#include "m2d_medos.h"
+#include "m2d_image.h"
+#include "m2d_dircache.h"
 #include "m2d_pagemap.h"
 
 
-// Static page map data table
-#define PAGE_MAP_SZ		(DK_NUM_PAGES / 8)
-uint8_t page_map[PAGE_MAP_SZ];
+// The page map of an image is kept in its handle, one bit per
+// page (set = used). Bits beyond the last page are permanently
+// marked as used.
+
+
+// clear_pagemap()
+// Marks all pages from DK_PAGE_START up to the end of the disk
+// as free
+//
+static void clear_pagemap(m2d_image_t *img)
+{
+	for (uint16_t i = 0; i < PAGE_MAP_SZ; i ++)
+		img->page_map[i] = 0;
+
+#if DK_PAGE_START > 0
+	for (uint16_t i = 0; i < DK_PAGE_START; i ++)
+		img->page_map[i / 64] |= 1ULL << (i % 64);
+#endif
+	for (uint16_t i = img->geo.pages; i < PAGE_MAP_SZ * 64; i ++)
+		img->page_map[i / 64] |= 1ULL << (i % 64);
+
+	// On large disks, the page whose pointer would be NIL is unusable
+	if (DK_NIL_PAGE / 13 < img->geo.pages)
+		m2d_set_page(img, DK_NIL_PAGE / 13, true);
+
+	img->next_page = DK_PAGE_START;
+}
 
 
 // m2d_set_page()
-// Marks the specified page number as "used" (TRUE) or free (FALSE)
+// Marks the specified page number as "used" (TRUE) or free (FALSE).
+// Returns the previous state of the page. Pages beyond the end
+// of the disk are always used.
 //
-uint8_t m2d_set_page(uint16_t n, bool used)
+bool m2d_set_page(m2d_image_t *img, uint16_t n, bool used)
 {
-	if (n >= DK_NUM_PAGES)
-		error(1, 0, "Illegal page number %d in page map\n", n);
+	if (n >= img->geo.pages)
+		return true;
 
-	uint8_t mask = (1 << (n % 8));
-	uint8_t old = page_map[n >> 3] & mask;
+	uint64_t mask = 1ULL << (n % 64);
+	bool old = (img->page_map[n / 64] & mask) != 0;
 
 	if (used)
-		page_map[n >> 3] |= mask;
+		img->page_map[n / 64] |= mask;
 	else
-		page_map[n >> 3] &= ~mask;
+		img->page_map[n / 64] &= ~mask;
 
 	return old;
 }
 
 
 // find_free_page()
-// Finds the next unmarked page in the page map
+// Returns the first free page at or after page n, wrapping around
+// at the end of the disk, or the number of pages if the disk is full
+//
+static uint16_t find_free_page(m2d_image_t *img, uint16_t n)
+{
+	uint16_t w = n / 64;
+
+	// Ignore pages before n in the first word
+	uint64_t free = ~img->page_map[w] & (~0ULL << (n % 64));
+
+	for (uint16_t i = 0; i <= PAGE_MAP_SZ; i ++)
+	{
+		if (free != 0)
+			return (w * 64) + __builtin_ctzll(free);
+
+		w = (w + 1) % PAGE_MAP_SZ;
+		free = ~img->page_map[w];
+	}
+	return img->geo.pages;
+}
+
+
+// m2d_find_free_page()
+// Allocates the next unmarked page in the page map, continuing
+// the search where the previous one left off. Returns
+// the number of pages of the disk if it is full.
+//
+uint16_t m2d_find_free_page(m2d_image_t *img)
+{
+	uint16_t n = find_free_page(img, img->next_page);
+
+	if (n >= img->geo.pages)
+	{
+		m2d_fail(img, 0, "Disk image full");
+		return img->geo.pages;
+	}
+
+	m2d_set_page(img, n, true);
+	img->next_page = (n + 1 < img->geo.pages) ? n + 1 : DK_PAGE_START;
+	return n;
+}
+
+
+// find_run()
+// Finds the first run of free pages at or after page n. Returns
+// the length of the run (0 if there is none) and its first page
+// in *start.
 //
-uint16_t m2d_find_free_page()
+static uint16_t find_run(m2d_image_t *img, uint16_t n, uint16_t *start)
 {
-	for (uint16_t i = DK_PAGE_START; i < DK_NUM_PAGES; i ++)
+	uint16_t w = n / 64;
+
+	if (w >= PAGE_MAP_SZ)
+		return 0;
+
+	// Find first free page
+	uint64_t bits = ~img->page_map[w] & (~0ULL << (n % 64));
+	while (bits == 0)
 	{
-		uint8_t p = m2d_set_page(i, true);
+		if (++ w == PAGE_MAP_SZ)
+			return 0;
+		bits = ~img->page_map[w];
+	}
+	*start = (w * 64) + __builtin_ctzll(bits);
 
-		if (p == 0)
-			return i;
+	// Find first used page after it
+	bits = img->page_map[w] & (~0ULL << (*start % 64));
+	while (bits == 0)
+	{
+		if (++ w == PAGE_MAP_SZ)
+			return img->geo.pages - *start;
+		bits = img->page_map[w];
 	}
-	error(1, 0, "Disk image full");
-	return 0;
+	return (w * 64) + __builtin_ctzll(bits) - *start;
+}
+
+
+// m2d_alloc_pages()
+// Allocates n pages and stores their numbers in pages[].
+// Returns FALSE (allocating nothing) if not enough pages are free.
+//
+// The interleave only permutes sectors within a track, so runs of
+// consecutive pages occupy consecutive tracks in the image. The
+// pages are taken from the first free run at or after the
+// allocation cursor (wrapping around) that holds all of them,
+// starting on a track boundary if the run allows and the file
+// fills at least one track. If there is no
+// such run, the largest runs are used until the rest fits into
+// the smallest run that can hold it (best fit).
+//
+#define TRACK_PAGES		(N_SECTORS / 8)
+
+bool m2d_alloc_pages(m2d_image_t *img, uint16_t n, uint16_t *pages)
+{
+	if (n > m2d_count_free_pages(img))
+		return m2d_fail(img, 0, "Disk image full");
+
+	uint16_t got = 0;
+	while (got < n)
+	{
+		uint16_t need = n - got;
+		uint16_t first = 0, first_len = 0;
+		uint16_t fit = 0, fit_len = 0;
+		uint16_t big = 0, big_len = 0;
+		uint16_t start, len;
+
+		// Survey all free runs, from the cursor to the end of the
+		// disk and then from its start up to the cursor
+		for (uint16_t pass = 0; pass < 2; pass ++)
+		{
+			uint16_t i = pass ? DK_PAGE_START : img->next_page;
+
+			while (((len = find_run(img, i, &start)) > 0)
+				&& ((pass == 0) || (start < img->next_page)))
+			{
+				if ((len >= need) && (first_len == 0))
+				{
+					first = start;
+					first_len = len;
+				}
+				if ((len >= need) && ((fit_len == 0) || (len < fit_len)))
+				{
+					fit = start;
+					fit_len = len;
+				}
+				if (len > big_len)
+				{
+					big = start;
+					big_len = len;
+				}
+				i = start + len;
+			}
+		}
+
+		if ((got == 0) && (first_len > 0))
+		{
+			// Whole file fits into one run; files of a track or
+			// more start on a track boundary if possible
+			uint16_t a = (first + TRACK_PAGES - 1) / TRACK_PAGES * TRACK_PAGES;
+			start = ((need >= TRACK_PAGES) && (a + need <= first + first_len))
+				? a : first;
+		}
+		else if (fit_len > 0)
+		{
+			start = fit;
+		}
+		else if (big_len > 0)
+		{
+			start = big;
+			need = big_len;
+		}
+		else
+		{
+			return m2d_fail(img, 0, "Page map inconsistent");
+		}
+
+		for (uint16_t i = 0; i < need; i ++)
+		{
+			m2d_set_page(img, start + i, true);
+			pages[got ++] = start + i;
+		}
+	}
+
+	// The next allocation continues after the last page
+	if (n > 0)
+	{
+		uint16_t next = pages[n - 1] + 1;
+		img->next_page = (next < img->geo.pages) ? next : DK_PAGE_START;
+	}
+	return true;
+}
+
+
+// m2d_count_free_pages()
+// Returns the number of unused pages in the page map
+//
+uint16_t m2d_count_free_pages(m2d_image_t *img)
+{
+	uint16_t n = 0;
+
+	for (uint16_t i = 0; i < PAGE_MAP_SZ; i ++)
+		n += __builtin_popcountll(~img->page_map[i]);
+	return n;
 }
 
 
 // m2d_free_pages()
 // Frees all pages in the supplied page table
 //
-void m2d_free_pages(uint16_t *pt)
+void m2d_free_pages(m2d_image_t *img, uint16_t *pt)
 {
 	for (uint16_t i = 0; i < M2D_PAGETAB_LEN; i ++)
 	{
 		uint16_t pg = bswap_16(*pt);
 
 		if (pg != DK_NIL_PAGE)
-			m2d_set_page(pg / 13, false);
+			m2d_set_page(img, pg / 13, false);
 			
 		*pt = bswap_16(DK_NIL_PAGE);
 		pt ++;
@@ -74,37 +271,69 @@ void m2d_free_pages(uint16_t *pt)
 }
 
 
-// load_pagemap()
-// Calculates the free page map of the specified image file
+// build_pagemap()
+// Calculates the free page map of the image from its directory
 //
-void m2d_load_pagemap(FILE *f)
+static bool build_pagemap(m2d_image_t *img)
 {
+	clear_pagemap(img);
+
 	for (uint16_t i = 0; i < DK_NUM_FILES; i ++)
 	{
-		struct disk_sector_t s;
 		struct file_desc_t *fdp;
 
-		// Load directory sector
-		if (! m2d_read_sector(f, &s, DK_DIR_START + i))
-			error(1, 0, "Can't build pagemap from image");
+		// Get cached directory entry
+		if ((fdp = m2d_dir_filedesc(img, i)) == NULL)
+			return m2d_fail(img, 0, "Can't build pagemap from image");
 
-		fdp = &(s.type.fd);
 		if (fdp->fd_kind != bswap_16(FDK_NOFILE))
 		{
 			// Check for internal data mismatch
 			if (bswap_16(fdp->file_num) != i)
-				error(1, 0, "File number mismatch in image directory");
+			{
+				return m2d_fail(img, 0, 
+					"File number mismatch in image directory");
+			}
 
 			// Add all used pages of this file to the page map
 			for (uint16_t j = 0; j < M2D_PAGETAB_LEN; j ++)
 			{
 				uint16_t p = bswap_16(fdp->page_tab[j]);
 
-				if (p != DK_NIL_PAGE)
-					m2d_set_page(p / 13, true);
-				else
+				if (p == DK_NIL_PAGE)
 					break;
+				if (p / 13 >= img->geo.pages)
+				{
+					return m2d_fail(img, 0, 
+						"Illegal page number %d in page map", p / 13);
+				}
+				m2d_set_page(img, p / 13, true);
 			}
 		}
 	}
-}
\ No newline at end of file
+	return true;
+}
+
+
+// m2d_load_pagemap()
+// Builds the page map of the image, timed as the pagemap phase
+//
+bool m2d_load_pagemap(m2d_image_t *img)
+{
+	m2d_phase_t ph = m2d_phase_begin(img, PH_PAGEMAP);
+	bool res = build_pagemap(img);
+
+	img->pagemap_ok = res;
+	m2d_phase_end(img, ph);
+	return res;
+}
+
+
+// m2d_get_pagemap()
+// Builds the page map of the image unless it is already loaded.
+// Allocations keep a loaded page map up to date.
+//
+bool m2d_get_pagemap(m2d_image_t *img)
+{
+	return img->pagemap_ok || m2d_load_pagemap(img);
+}
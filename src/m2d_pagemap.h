@@ -17,8 +17,12 @@
 
 // Forward declarations
 //
-uint16_t m2d_find_free_page();
-void m2d_free_pages(uint16_t *pt);
-void m2d_load_pagemap(FILE *f);
+bool m2d_set_page(m2d_image_t *img, uint16_t n, bool used);
+uint16_t m2d_find_free_page(m2d_image_t *img);
+uint16_t m2d_count_free_pages(m2d_image_t *img);
+bool m2d_alloc_pages(m2d_image_t *img, uint16_t n, uint16_t *pages);
+void m2d_free_pages(m2d_image_t *img, uint16_t *pt);
+bool m2d_load_pagemap(m2d_image_t *img);
+bool m2d_get_pagemap(m2d_image_t *img);
 
 #endif
\ No newline at end of file
@@ -0,0 +1,219 @@
+//=====================================================
+// m2d_replay.c
+// Replays a sector access trace against an image
+//
+// Lilith Machine Disk Utility
+//
+// Guido Hoss, 25.03.2022
+//
+// Published by Guido Hoss under GNU Public License V3.
+//=====================================================
+
+#include <string.h>
+#include <inttypes.h>
+#include "libm2disk.h"
+#include "m2d_image.h"
+
+
+// I/O backends to compare
+typedef struct {
+	const char *name;
+	uint16_t flags;		// Flags for m2d_open()
+} backend_t;
+
+static const backend_t backends[] = {
+	{ "mmap", 0 },
+	{ "pread", M2D_NOMAP }
+};
+#define NUM_BACKENDS	(sizeof(backends) / sizeof(backend_t))
+
+// A request of consecutive logical sectors, as issued by the library
+typedef struct {
+	uint8_t op;			// TR_READ or TR_WRITE
+	uint16_t n;			// First logical sector
+	uint16_t cnt;		// Number of sectors
+	uint32_t idx;		// Index of first sector in data buffer
+} request_t;
+
+
+// usage()
+// Prints usage information and exits
+//
+static void usage()
+{
+	error(1, 0, "USAGE: m2disk-replay [-s] [-n repeat] [-b mmap|pread]"
+		" trace_file img_file");
+}
+
+
+int main(int argc, char **argv)
+{
+	const backend_t *only = NULL;
+	uint16_t repeat = 1;
+	bool split = false;
+	char c;
+
+	while ((c = getopt(argc, argv, "b:n:s")) != -1)
+	{
+		switch (c)
+		{
+			case 'b' :
+				for (uint16_t i = 0; i < NUM_BACKENDS; i ++)
+				{
+					if (strcmp(optarg, backends[i].name) == 0)
+						only = &backends[i];
+				}
+				if (only == NULL)
+					error(1, 0, "Unknown backend '%s'", optarg);
+				break;
+
+			case 'n' :
+				repeat = atoi(optarg);
+				if (repeat < 1)
+					error(1, 0, "Repeat count must be positive");
+				break;
+
+			case 's' :
+				// Issue every sector as a separate request
+				split = true;
+				break;
+
+			default :
+				usage();
+				break;
+		}
+	}
+	if (argc - optind != 2)
+		usage();
+
+	char *tracefile = argv[optind];
+	char *imgfile = argv[optind + 1];
+
+	// Load the trace
+	FILE *tf = fopen(tracefile, "r");
+	if (tf == NULL)
+		error(1, errno, "Can't open trace file '%s'", tracefile);
+	if (! m2d_trace_open(tf))
+		error(1, 0, "'%s' is not a valid trace file", tracefile);
+
+	struct m2d_trace_rec_t r;
+	request_t *req = NULL;
+	uint16_t *phys = NULL;
+	uint32_t nreq = 0, nsect = 0, max = 0;
+	uint32_t last_usec = 0;
+	uint32_t nread = 0, nwrite = 0;
+
+	while (m2d_trace_next(tf, &r))
+	{
+		if (nsect == max)
+		{
+			max = max ? max * 2 : 4096;
+			req = realloc(req, max * sizeof(request_t));
+			phys = realloc(phys, max * sizeof(uint16_t));
+			if ((req == NULL) || (phys == NULL))
+				error(1, errno, "Can't allocate trace buffer");
+		}
+
+		if (r.physical >= DK_MAX_SECTORS)
+			error(1, 0, "Bad sector %d in trace", r.physical);
+
+		request_t *q = (nreq > 0) ? &req[nreq - 1] : NULL;
+		if ((r.flags & TR_CONT) && (! split) && (q != NULL)
+			&& (q->op == r.op) && (q->n + q->cnt == r.logical))
+		{
+			q->cnt ++;
+		}
+		else
+		{
+			q = &req[nreq ++];
+			q->op = r.op;
+			q->n = r.logical;
+			q->cnt = 1;
+			q->idx = nsect;
+		}
+		phys[nsect ++] = r.physical;
+		last_usec = r.usec;
+		if (r.op == TR_WRITE)
+			nwrite ++;
+		else
+			nread ++;
+	}
+	fclose(tf);
+
+	if (nreq == 0)
+		error(1, 0, "Trace file '%s' is empty", tracefile);
+
+	// Writes put back the current image contents, so the image is
+	// left unchanged by the replay
+	struct disk_sector_t *data = malloc(nsect * sizeof(struct disk_sector_t));
+	if (data == NULL)
+		error(1, errno, "Can't allocate sector buffer");
+
+	FILE *f = fopen(imgfile, "r");
+	if (f == NULL)
+		error(1, errno, "Can't open image file '%s'", imgfile);
+	for (uint32_t i = 0; i < nsect; i ++)
+	{
+		if (pread(fileno(f), &data[i], DK_SECTOR_SZ,
+			(off_t) phys[i] * DK_SECTOR_SZ) != DK_SECTOR_SZ)
+			error(1, errno, "Can't read sector %d of '%s'", phys[i], imgfile);
+	}
+	fclose(f);
+
+	printf("> Trace: %u requests, %u sectors read, %u written, "
+		"recorded in %.3f ms\n", nreq, nread, nwrite, last_usec / 1e3);
+	printf("%-8s %10s %10s %12s %10s %10s\n",
+		"backend", "replay_ms", "sync_ms", "us/request", "MB/s", "syscalls");
+
+	for (uint16_t b = 0; b < NUM_BACKENDS; b ++)
+	{
+		const backend_t *be = &backends[b];
+		double best = 1e30, best_sync = 0;
+		m2d_stats_t st;
+
+		if ((only != NULL) && (only != be))
+			continue;
+
+		for (uint16_t k = 0; k < repeat; k ++)
+		{
+			m2d_image_t *img = m2d_open(imgfile, be->flags | M2D_STATS);
+			if (img == NULL)
+				error(1, errno, "Can't open image file '%s'", imgfile);
+
+			double t0 = m2d_now();
+			for (uint32_t i = 0; i < nreq; i ++)
+			{
+				request_t *q = &req[i];
+				bool res = (q->op == TR_WRITE)
+					? m2d_write_sectors(img, &data[q->idx], q->n, q->cnt)
+					: m2d_read_sectors(img, &data[q->idx], q->n, q->cnt);
+
+				if (! res)
+					error(1, 0, "%s", m2d_error(img));
+			}
+			double t1 = m2d_now();
+			if (! m2d_sync(img))
+				error(1, 0, "%s", m2d_error(img));
+			double t2 = m2d_now();
+
+			if (t1 - t0 < best)
+			{
+				best = t1 - t0;
+				best_sync = t2 - t1;
+				m2d_get_stats(img, &st);
+			}
+			if (! m2d_close(img))
+				error(1, 0, "%s", m2d_error(img));
+		}
+
+		printf("%-8s %10.3f %10.3f %12.3f %10.2f %10" PRIu64 "\n", be->name,
+			best * 1e3, best_sync * 1e3, best * 1e6 / nreq,
+			nsect * (double) DK_SECTOR_SZ / (best + best_sync) / 1e6,
+			st.syscalls);
+	}
+
+	free(data);
+	free(phys);
+	free(req);
+	return 0;
+}
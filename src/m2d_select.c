@@ -0,0 +1,338 @@
+//=====================================================
+// m2d_select.c
+// File selection by include and exclude patterns
+//
+// Lilith Machine Disk Utility
+//
+// Guido Hoss, 25.03.2022
+//
+// Published by Guido Hoss under GNU Public License V3.
+//=====================================================
+
+#include <string.h>
+#include <fnmatch.h>
+#include "m2d_select.h"
+
+// A file is selected if it matches any include pattern (or there
+// are none) and no exclude pattern. Patterns are compiled once
+// into three kinds of matchers, so a name is tested in roughly
+// constant time however many patterns there are:
+//
+// - Literal names (no wildcards) in a hash table
+// - "*suffix" patterns in lists by the last character of the suffix
+// - All other patterns, which are passed to fnmatch()
+//
+// All matchers behave like fnmatch() with FNM_PATHNAME.
+
+// Initial size of the literal name hash table (power of 2)
+#define LIT_HASH_SZ		64
+
+// A compiled pattern
+struct pattern_t {
+	char *text;					// Name, suffix or glob pattern
+	uint16_t len;				// Length of text
+	struct pattern_t *next;		// Next pattern in list or hash chain
+};
+
+// Compiled include or exclude patterns
+typedef struct {
+	uint32_t n;					// Number of patterns
+	bool any;					// Pattern "*" present
+	struct pattern_t **lit;		// Hash table of literal names
+	uint32_t lit_sz;			// Size of hash table
+	uint32_t nlit;				// Number of literal names
+	struct pattern_t *sfx[256];	// Suffixes by their last character
+	struct pattern_t *glob;		// Other patterns
+} pattern_set_t;
+
+struct m2d_select {
+	pattern_set_t inc;			// Include patterns
+	pattern_set_t exc;			// Exclude patterns
+};
+
+
+// name_hash()
+// Returns the hash value of a null-terminated name
+//
+static uint32_t name_hash(const char *s)
+{
+	uint32_t h = 2166136261u;
+
+	while (*s != '\0')
+		h = (h ^ (uint8_t) *s ++) * 16777619u;
+	return h;
+}
+
+
+// is_literal()
+// Returns TRUE if string s contains no wildcard characters
+//
+static bool is_literal(const char *s)
+{
+	return strpbrk(s, "*?[\\") == NULL;
+}
+
+
+// grow_lit()
+// Doubles the size of the literal hash table
+//
+static bool grow_lit(pattern_set_t *s)
+{
+	uint32_t sz = s->lit_sz ? 2 * s->lit_sz : LIT_HASH_SZ;
+	struct pattern_t **t = calloc(sz, sizeof(struct pattern_t *));
+
+	if (t == NULL)
+		return false;
+
+	for (uint32_t i = 0; i < s->lit_sz; i ++)
+	{
+		struct pattern_t *p = s->lit[i];
+
+		while (p != NULL)
+		{
+			struct pattern_t *next = p->next;
+			uint32_t h = name_hash(p->text) & (sz - 1);
+
+			p->next = t[h];
+			t[h] = p;
+			p = next;
+		}
+	}
+	free(s->lit);
+	s->lit = t;
+	s->lit_sz = sz;
+	return true;
+}
+
+
+// add_pattern()
+// Compiles pattern text into set s
+//
+static bool add_pattern(pattern_set_t *s, const char *text)
+{
+	if (strcmp(text, "*") == 0)
+	{
+		s->any = true;
+		s->n ++;
+		return true;
+	}
+
+	struct pattern_t *p = malloc(sizeof(struct pattern_t));
+	if (p == NULL)
+		return false;
+
+	bool suffix = (text[0] == '*') && (text[1] != '\0')
+		&& is_literal(text + 1);
+
+	p->text = strdup(suffix ? text + 1 : text);
+	if (p->text == NULL)
+	{
+		free(p);
+		return false;
+	}
+	p->len = strlen(p->text);
+
+	if (suffix)
+	{
+		struct pattern_t **l = &s->sfx[(uint8_t) p->text[p->len - 1]];
+
+		p->next = *l;
+		*l = p;
+	}
+	else if (is_literal(text))
+	{
+		if ((s->nlit >= s->lit_sz) && (! grow_lit(s)))
+		{
+			free(p->text);
+			free(p);
+			return false;
+		}
+
+		uint32_t h = name_hash(p->text) & (s->lit_sz - 1);
+		p->next = s->lit[h];
+		s->lit[h] = p;
+		s->nlit ++;
+	}
+	else
+	{
+		p->next = s->glob;
+		s->glob = p;
+	}
+	s->n ++;
+	return true;
+}
+
+
+// match_set()
+// Returns TRUE if name matches any pattern in set s
+//
+static bool match_set(const pattern_set_t *s, const char *name)
+{
+	if (s->n == 0)
+		return false;
+
+	size_t len = strlen(name);
+	const char *slash = strchr(name, '/');
+
+	// '*' doesn't match a '/' (FNM_PATHNAME)
+	if (s->any && (slash == NULL))
+		return true;
+
+	if (s->nlit > 0)
+	{
+		struct pattern_t *p = s->lit[name_hash(name) & (s->lit_sz - 1)];
+
+		for (; p != NULL; p = p->next)
+		{
+			if (strcmp(p->text, name) == 0)
+				return true;
+		}
+	}
+
+	if (len > 0)
+	{
+		struct pattern_t *p = s->sfx[(uint8_t) name[len - 1]];
+
+		for (; p != NULL; p = p->next)
+		{
+			const char *tail = name + len - p->len;
+
+			if ((p->len <= len) && (memcmp(tail, p->text, p->len) == 0)
+				&& ((slash == NULL) || (slash >= tail)))
+				return true;
+		}
+	}
+
+	for (struct pattern_t *p = s->glob; p != NULL; p = p->next)
+	{
+		if (fnmatch(p->text, name, FNM_PATHNAME) == 0)
+			return true;
+	}
+	return false;
+}
+
+
+// free_list()
+// Frees a list of patterns
+//
+static void free_list(struct pattern_t *p)
+{
+	while (p != NULL)
+	{
+		struct pattern_t *next = p->next;
+
+		free(p->text);
+		free(p);
+		p = next;
+	}
+}
+
+
+// free_set()
+// Frees all patterns of set s
+//
+static void free_set(pattern_set_t *s)
+{
+	for (uint32_t i = 0; i < s->lit_sz; i ++)
+		free_list(s->lit[i]);
+	for (uint16_t i = 0; i < 256; i ++)
+		free_list(s->sfx[i]);
+	free_list(s->glob);
+	free(s->lit);
+}
+
+
+// m2d_select_new()
+// Returns an empty selection, which selects all files, or NULL
+// with errno set if it can't be allocated
+//
+m2d_select_t *m2d_select_new()
+{
+	return calloc(1, sizeof(m2d_select_t));
+}
+
+
+// m2d_select_free()
+// Frees a selection and all its patterns
+//
+void m2d_select_free(m2d_select_t *sel)
+{
+	if (sel != NULL)
+	{
+		free_set(&sel->inc);
+		free_set(&sel->exc);
+		free(sel);
+	}
+}
+
+
+// m2d_select_add()
+// Adds an include or exclude pattern to the selection. Returns
+// FALSE with errno set if it can't be allocated.
+//
+bool m2d_select_add(m2d_select_t *sel, const char *pattern, bool exclude)
+{
+	return add_pattern(exclude ? &sel->exc : &sel->inc, pattern);
+}
+
+
+// m2d_select_add_file()
+// Adds the patterns in file fname ('-': standard input), one per
+// line, to the selection. Empty lines and lines starting with '#'
+// are ignored. Returns FALSE with errno set if the file can't be
+// read.
+//
+bool m2d_select_add_file(m2d_select_t *sel, const char *fname, bool exclude)
+{
+	bool std = (strcmp(fname, "-") == 0);
+	FILE *f = std ? stdin : fopen(fname, "r");
+	char *line = NULL;
+	size_t sz = 0;
+	bool res = true;
+
+	if (f == NULL)
+		return false;
+
+	while (res && (getline(&line, &sz, f) != -1))
+	{
+		size_t len = strlen(line);
+
+		// Remove line end and trailing blanks
+		while ((len > 0) && isspace((uint8_t) line[len - 1]))
+			line[-- len] = '\0';
+
+		if ((len > 0) && (line[0] != '#'))
+			res = m2d_select_add(sel, line, exclude);
+	}
+	if (res && ferror(f))
+		res = false;
+
+	free(line);
+	if (! std)
+		fclose(f);
+	return res;
+}
+
+
+// m2d_select_match()
+// Returns TRUE if file "name" is selected. A NULL selection
+// selects all files.
+//
+bool m2d_select_match(const m2d_select_t *sel, const char *name)
+{
+	if (sel == NULL)
+		return true;
+
+	return ((sel->inc.n == 0) || match_set(&sel->inc, name))
+		&& (! match_set(&sel->exc, name));
+}
+
+
+// m2d_select_explicit()
+// Returns TRUE if files are selected by include patterns rather
+// than by default
+//
+bool m2d_select_explicit(const m2d_select_t *sel)
+{
+	return (sel != NULL) && (sel->inc.n > 0);
+}
@@ -0,0 +1,30 @@
+//=====================================================
+// m2d_select.h
+// File selection by include and exclude patterns
+//
+// Lilith Machine Disk Utility
+//
+// Guido Hoss, 25.03.2022
+//
+// Published by Guido Hoss under GNU Public License V3.
+//=====================================================
+
+#ifndef _M2D_SELECT_H
+#define _M2D_SELECT_H   1
+
+#include "m2disk.h"
+
+// Compiled file selection
+typedef struct m2d_select m2d_select_t;
+
+
+// Function declarations
+//
+m2d_select_t *m2d_select_new();
+void m2d_select_free(m2d_select_t *sel);
+bool m2d_select_add(m2d_select_t *sel, const char *pattern, bool exclude);
+bool m2d_select_add_file(m2d_select_t *sel, const char *fname, bool exclude);
+bool m2d_select_match(const m2d_select_t *sel, const char *name);
+bool m2d_select_explicit(const m2d_select_t *sel);
+
+#endif
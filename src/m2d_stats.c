@@ -0,0 +1,154 @@
+//=====================================================
+// m2d_stats.c
+// I/O statistics and phase timers
+//
+// Lilith Machine Disk Utility
+//
+// Guido Hoss, 25.03.2022
+//
+// Published by Guido Hoss under GNU Public License V3.
+//=====================================================
+
+#include <string.h>
+#include <inttypes.h>
+#include "m2d_image.h"
+#include "m2d_stats.h"
+
+
+// Phase names for the summary and the machine-readable output
+static const char *phase_name[PH_NUM] = {
+	"Pagemap load", "Directory scan", "Data transfer", "Directory commit"
+};
+static const char *phase_key[PH_NUM] = {
+	"pagemap", "dirscan", "transfer", "commit"
+};
+
+
+// m2d_stats_start()
+// Resets the statistics of a newly opened image. Nothing is
+// counted unless "collect" is set.
+//
+void m2d_stats_start(m2d_image_t *img, bool collect)
+{
+	bzero(&img->stats, sizeof(m2d_stats_t));
+	img->collect = collect;
+	img->phase = PH_NONE;
+	img->last_phys = 0;
+	img->open_time = m2d_now();
+}
+
+
+// m2d_count_io()
+// Counts an access to cnt physical sectors starting at phys,
+// issued with "calls" system calls. May be called from several
+// threads at once.
+//
+void m2d_count_io(
+	m2d_image_t *img, bool write, uint16_t phys, uint16_t cnt, uint16_t calls
+) {
+	m2d_stats_t *st = &img->stats;
+
+	if (! img->collect)
+		return;
+
+	uint16_t prev = __atomic_exchange_n(
+		&img->last_phys, phys + cnt, __ATOMIC_RELAXED);
+	uint16_t dist = (phys > prev) ? phys - prev : prev - phys;
+
+	__atomic_add_fetch(write ? &st->sectors_written : &st->sectors_read,
+		cnt, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&st->syscalls, calls, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&st->seek_dist, dist, __ATOMIC_RELAXED);
+}
+
+
+// m2d_count_convert()
+// Counts n bytes passed through text conversion
+//
+void m2d_count_convert(m2d_image_t *img, size_t n)
+{
+	if (img->collect)
+		__atomic_add_fetch(&img->stats.bytes_converted, n, __ATOMIC_RELAXED);
+}
+
+
+// m2d_phase_begin()
+// Starts timing "phase" and returns the phase which was active
+// before; the time of that phase is suspended until the new one
+// is ended with m2d_phase_end(). Only for the calling thread of
+// the library.
+//
+m2d_phase_t m2d_phase_begin(m2d_image_t *img, m2d_phase_t phase)
+{
+	m2d_phase_t prev = img->phase;
+
+	if (img->collect)
+	{
+		double t = m2d_now();
+
+		if (prev != PH_NONE)
+			img->stats.phase_time[prev] += t - img->phase_t0;
+		img->phase_t0 = t;
+	}
+	img->phase = phase;
+	return prev;
+}
+
+
+// m2d_phase_end()
+// Ends the current phase and resumes the phase "prev" returned
+// by m2d_phase_begin()
+//
+void m2d_phase_end(m2d_image_t *img, m2d_phase_t prev)
+{
+	m2d_phase_begin(img, prev);
+}
+
+
+// m2d_get_stats()
+// Returns a copy of the current statistics of the image
+//
+void m2d_get_stats(m2d_image_t *img, m2d_stats_t *st)
+{
+	// Account for the running phase up to now
+	m2d_phase_begin(img, img->phase);
+
+	memcpy(st, &img->stats, sizeof(m2d_stats_t));
+	st->total_time = m2d_now() - img->open_time;
+}
+
+
+// m2d_print_stats()
+// Prints the statistics as a summary, or as "key value" lines
+// for machine processing
+//
+void m2d_print_stats(m2d_stats_t *st, bool machine)
+{
+	if (machine)
+	{
+		printf("m2d_sectors_read %" PRIu64 "\n", st->sectors_read);
+		printf("m2d_sectors_written %" PRIu64 "\n", st->sectors_written);
+		printf("m2d_syscalls %" PRIu64 "\n", st->syscalls);
+		printf("m2d_seek_distance %" PRIu64 "\n", st->seek_dist);
+		printf("m2d_bytes_converted %" PRIu64 "\n", st->bytes_converted);
+		for (uint16_t i = 0; i < PH_NUM; i ++)
+			printf("m2d_time_%s %.6f\n", phase_key[i], st->phase_time[i]);
+		printf("m2d_time_total %.6f\n", st->total_time);
+		return;
+	}
+
+	printf("> I/O statistics:\n");
+	printf("  %-20s %12" PRIu64 "\n", "Sectors read:", st->sectors_read);
+	printf("  %-20s %12" PRIu64 "\n", "Sectors written:", st->sectors_written);
+	printf("  %-20s %12" PRIu64 "\n", "System calls:", st->syscalls);
+	printf("  %-20s %12" PRIu64 " sectors\n", "Seek distance:", st->seek_dist);
+	printf("  %-20s %12" PRIu64 "\n", "Bytes converted:", st->bytes_converted);
+	for (uint16_t i = 0; i < PH_NUM; i ++)
+	{
+		char label[32];
+
+		snprintf(label, sizeof(label), "%s:", phase_name[i]);
+		printf("  %-20s %12.3f ms\n", label, st->phase_time[i] * 1000);
+	}
+	printf("  %-20s %12.3f ms\n", "Total:", st->total_time * 1000);
+}
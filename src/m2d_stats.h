@@ -0,0 +1,52 @@
+//=====================================================
+// m2d_stats.h
+// I/O statistics and phase timers
+//
+// Lilith Machine Disk Utility
+//
+// Guido Hoss, 25.03.2022
+//
+// Published by Guido Hoss under GNU Public License V3.
+//=====================================================
+
+#ifndef _M2D_STATS_H
+#define _M2D_STATS_H   1
+
+#include "m2disk.h"
+
+
+// Timed phases of an operation
+typedef enum {
+	PH_NONE = -1,		// Not in a timed phase
+	PH_PAGEMAP,			// Building the page map
+	PH_DIRSCAN,			// Reading and searching the directory
+	PH_TRANSFER,		// Transferring file data
+	PH_COMMIT,			// Writing back the directory and image
+	PH_NUM
+} m2d_phase_t;
+
+// Statistics of an image handle
+typedef struct {
+	uint64_t sectors_read;		// Sectors read from the image
+	uint64_t sectors_written;	// Sectors written to the image
+	uint64_t syscalls;			// I/O system calls on the image file
+	uint64_t seek_dist;			// Total physical seek distance (sectors)
+	uint64_t bytes_converted;	// Bytes passed through text conversion
+	double phase_time[PH_NUM];	// Time spent in each phase (s)
+	double total_time;			// Time since the image was opened (s)
+} m2d_stats_t;
+
+
+// Function declarations
+//
+void m2d_stats_start(m2d_image_t *img, bool collect);
+void m2d_count_io(
+	m2d_image_t *img, bool write, uint16_t phys, uint16_t cnt, uint16_t calls
+);
+void m2d_count_convert(m2d_image_t *img, size_t n);
+m2d_phase_t m2d_phase_begin(m2d_image_t *img, m2d_phase_t phase);
+void m2d_phase_end(m2d_image_t *img, m2d_phase_t prev);
+void m2d_get_stats(m2d_image_t *img, m2d_stats_t *st);
+void m2d_print_stats(m2d_stats_t *st, bool machine);
+
+#endif
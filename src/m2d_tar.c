@@ -0,0 +1,96 @@
+//=====================================================
+// m2d_tar.c
+// Tar (ustar) archive output
+//
+// Lilith Machine Disk Utility
+//
+// Guido Hoss, 25.03.2022
+//
+// Published by Guido Hoss under GNU Public License V3.
+//=====================================================
+
+#include <string.h>
+#include "m2d_tar.h"
+
+
+#define TAR_BLOCK_SZ	512
+
+// POSIX ustar header block
+struct tar_header_t {
+	char name[100];
+	char mode[8];
+	char uid[8];
+	char gid[8];
+	char size[12];
+	char mtime[12];
+	char chksum[8];
+	char typeflag;
+	char linkname[100];
+	char magic[6];
+	char version[2];
+	char uname[32];
+	char gname[32];
+	char devmajor[8];
+	char devminor[8];
+	char prefix[155];
+	char pad[12];
+};
+
+
+// m2d_tar_header()
+// Writes the header block of a regular file to the archive
+//
+bool m2d_tar_header(FILE *of, char *name, uint32_t size, time_t mtime)
+{
+	struct tar_header_t h;
+
+	bzero(&h, sizeof(h));
+	strncpy(h.name, name, sizeof(h.name) - 1);
+	snprintf(h.mode, sizeof(h.mode), "%07o", 0644);
+	snprintf(h.uid, sizeof(h.uid), "%07o", 0);
+	snprintf(h.gid, sizeof(h.gid), "%07o", 0);
+	snprintf(h.size, sizeof(h.size), "%011o", size);
+	snprintf(h.mtime, sizeof(h.mtime), "%011lo", (unsigned long) mtime);
+	h.typeflag = '0';
+	memcpy(h.magic, "ustar", 6);
+	memcpy(h.version, "00", 2);
+
+	// Checksum is computed with the checksum field set to blanks
+	unsigned int sum = 0;
+	memset(h.chksum, ' ', sizeof(h.chksum));
+	for (uint16_t i = 0; i < sizeof(h); i ++)
+		sum += ((uint8_t *) &h)[i];
+	snprintf(h.chksum, sizeof(h.chksum), "%06o", sum);
+
+	return fwrite(&h, sizeof(h), 1, of) == 1;
+}
+
+
+// m2d_tar_pad()
+// Completes a file of "size" bytes of which "written" bytes
+// have been written, and pads it to the next block boundary
+//
+bool m2d_tar_pad(FILE *of, uint32_t written, uint32_t size)
+{
+	uint32_t n = (size - written) 
+		+ (TAR_BLOCK_SZ - size % TAR_BLOCK_SZ) % TAR_BLOCK_SZ;
+
+	while (n -- > 0)
+	{
+		if (fputc(0, of) == EOF)
+			return false;
+	}
+	return true;
+}
+
+
+// m2d_tar_end()
+// Writes the two zero blocks which terminate the archive
+//
+bool m2d_tar_end(FILE *of)
+{
+	char b[2 * TAR_BLOCK_SZ];
+
+	bzero(b, sizeof(b));
+	return (fwrite(b, sizeof(b), 1, of) == 1) && (fflush(of) == 0);
+}
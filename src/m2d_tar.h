@@ -0,0 +1,25 @@
+//=====================================================
+// m2d_tar.h
+// Tar (ustar) archive output
+//
+// Lilith Machine Disk Utility
+//
+// Guido Hoss, 25.03.2022
+//
+// Published by Guido Hoss under GNU Public License V3.
+//=====================================================
+
+#ifndef _M2D_TAR_H
+#define _M2D_TAR_H   1
+
+#include <time.h>
+#include "m2disk.h"
+
+
+// Function declarations
+//
+bool m2d_tar_header(FILE *of, char *name, uint32_t size, time_t mtime);
+bool m2d_tar_pad(FILE *of, uint32_t written, uint32_t size);
+bool m2d_tar_end(FILE *of);
+
+#endif
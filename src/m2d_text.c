@@ -0,0 +1,155 @@
+//=====================================================
+// m2d_text.c
+// Text file conversion (Lilith<->Unix)
+//
+// Lilith Machine Disk Utility
+//
+// Guido Hoss, 25.03.2022
+//
+// Published by Guido Hoss under GNU Public License V3.
+//=====================================================
+
+#include <pthread.h>
+#include "m2d_text.h"
+
+#if defined(__x86_64__) || (defined(__i386__) && defined(__SSE2__))
+#define M2D_X86_SIMD	1
+#include <immintrin.h>
+#endif
+
+
+#define M2_EOL	'\036'
+#define UX_EOL	'\n'
+#define UX_TAB	'\t'
+
+
+// convert_scalar()
+// Converts line endings byte by byte
+//
+static void convert_scalar(uint8_t *p, size_t n, bool to_unix)
+{
+	for (size_t i = 0; i < n; i ++, p ++)
+	{
+		switch (*p)
+		{
+			case M2_EOL :
+				if (to_unix) *p = UX_EOL;
+				break;
+
+			case UX_EOL :
+				if (! to_unix) *p = M2_EOL;
+				break;
+			
+			case UX_TAB :
+				if (! to_unix) *p = ' ';
+				break;
+
+			default :
+				break;
+		}
+	}
+}
+
+
+#ifdef M2D_X86_SIMD
+
+// convert_sse2()
+// Converts line endings 16 bytes at a time. Matching bytes are
+// flipped into their replacement with an XOR mask.
+//
+static void convert_sse2(uint8_t *p, size_t n, bool to_unix)
+{
+	const __m128i eol_m2 = _mm_set1_epi8(M2_EOL);
+	const __m128i eol_ux = _mm_set1_epi8(UX_EOL);
+	const __m128i tab = _mm_set1_epi8(UX_TAB);
+	const __m128i eol_x = _mm_set1_epi8(M2_EOL ^ UX_EOL);
+	const __m128i tab_x = _mm_set1_epi8(UX_TAB ^ ' ');
+	size_t i = 0;
+
+	for (; i + 16 <= n; i += 16)
+	{
+		__m128i v = _mm_loadu_si128((__m128i *) (p + i));
+		__m128i x;
+
+		if (to_unix)
+		{
+			x = _mm_and_si128(_mm_cmpeq_epi8(v, eol_m2), eol_x);
+		}
+		else
+		{
+			x = _mm_or_si128(
+				_mm_and_si128(_mm_cmpeq_epi8(v, eol_ux), eol_x),
+				_mm_and_si128(_mm_cmpeq_epi8(v, tab), tab_x)
+			);
+		}
+		_mm_storeu_si128((__m128i *) (p + i), _mm_xor_si128(v, x));
+	}
+	convert_scalar(p + i, n - i, to_unix);
+}
+
+
+// convert_avx2()
+// Converts line endings 32 bytes at a time
+//
+__attribute__((target("avx2")))
+static void convert_avx2(uint8_t *p, size_t n, bool to_unix)
+{
+	const __m256i eol_m2 = _mm256_set1_epi8(M2_EOL);
+	const __m256i eol_ux = _mm256_set1_epi8(UX_EOL);
+	const __m256i tab = _mm256_set1_epi8(UX_TAB);
+	const __m256i eol_x = _mm256_set1_epi8(M2_EOL ^ UX_EOL);
+	const __m256i tab_x = _mm256_set1_epi8(UX_TAB ^ ' ');
+	size_t i = 0;
+
+	for (; i + 32 <= n; i += 32)
+	{
+		__m256i v = _mm256_loadu_si256((__m256i *) (p + i));
+		__m256i x;
+
+		if (to_unix)
+		{
+			x = _mm256_and_si256(_mm256_cmpeq_epi8(v, eol_m2), eol_x);
+		}
+		else
+		{
+			x = _mm256_or_si256(
+				_mm256_and_si256(_mm256_cmpeq_epi8(v, eol_ux), eol_x),
+				_mm256_and_si256(_mm256_cmpeq_epi8(v, tab), tab_x)
+			);
+		}
+		_mm256_storeu_si256((__m256i *) (p + i), _mm256_xor_si256(v, x));
+	}
+	convert_sse2(p + i, n - i, to_unix);
+}
+
+#endif
+
+
+// Conversion kernel, selected once on first use
+static void (*convert)(uint8_t *, size_t, bool);
+static pthread_once_t convert_once = PTHREAD_ONCE_INIT;
+
+
+// convert_select()
+// Chooses the fastest conversion kernel for this CPU
+//
+static void convert_select()
+{
+#ifdef M2D_X86_SIMD
+	__builtin_cpu_init();
+	convert = __builtin_cpu_supports("avx2") ? convert_avx2 : convert_sse2;
+#else
+	convert = convert_scalar;
+#endif
+}
+
+
+// m2d_text_convert()
+// Converts all line endings in the n bytes of buf, which may
+// span any number of sectors. Safe to call from several threads.
+//
+void m2d_text_convert(void *buf, size_t n, bool to_unix)
+{
+	pthread_once(&convert_once, convert_select);
+	convert(buf, n, to_unix);
+}
@@ -0,0 +1,22 @@
+//=====================================================
+// m2d_text.h
+// Text file conversion (Lilith<->Unix)
+//
+// Lilith Machine Disk Utility
+//
+// Guido Hoss, 25.03.2022
+//
+// Published by Guido Hoss under GNU Public License V3.
+//=====================================================
+
+#ifndef _M2D_TEXT_H
+#define _M2D_TEXT_H   1
+
+#include "m2disk.h"
+
+
+// Function declarations
+//
+void m2d_text_convert(void *buf, size_t n, bool to_unix);
+
+#endif
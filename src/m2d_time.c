@@ -30,6 +30,32 @@ void m2d_system_time(struct tm_minute_t *tim)
 }
 
 
+// m2d_unix_time()
+// Converts the supplied Lilith time to a Unix time value
+// (local time zone); returns 0 if the time is not set
+//
+time_t m2d_unix_time(struct tm_minute_t *tm)
+{
+	uint16_t tmm = bswap_16(tm->min);
+	uint16_t tmd = bswap_16(tm->day);
+	struct tm t;
+
+	if (tmd == 0)
+		return 0;
+
+	t.tm_sec = 0;
+	t.tm_min = tmm % 60;
+	t.tm_hour = tmm / 60;
+	t.tm_mday = tmd % 32;
+	t.tm_mon = ((tmd >> 5) % 16) - 1;
+	t.tm_year = tmd >> 9;
+	t.tm_isdst = -1;
+
+	time_t res = mktime(&t);
+	return (res == -1) ? 0 : res;
+}
+
+
 // m2d_print_time()
 // Prints the supplied Lilith time to stdout
 //
@@ -51,4 +77,17 @@ void m2d_print_time(struct tm_minute_t *tm)
 			t_day, t_mon, t_yr, t_hr, t_min
 		);
 	}
-}
\ No newline at end of file
+}
+
+
+// m2d_now()
+// Returns a monotonic time stamp in seconds for measuring
+// elapsed time
+//
+double m2d_now()
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
@@ -12,6 +12,7 @@
 #ifndef _M2D_TIME_H
 #define _M2D_TIME_H   1
 
+#include <time.h>
 #include "m2disk.h"
 
 
@@ -26,5 +27,7 @@ struct tm_minute_t {
 //
 void m2d_system_time(struct tm_minute_t *tm);
 void m2d_print_time(struct tm_minute_t *tm);
+time_t m2d_unix_time(struct tm_minute_t *tm);
+double m2d_now();
 
 #endif
\ No newline at end of file
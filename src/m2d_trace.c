@@ -0,0 +1,112 @@
+//=====================================================
+// m2d_trace.c
+// Sector access trace recording
+//
+// Lilith Machine Disk Utility
+//
+// Guido Hoss, 25.03.2022
+//
+// Published by Guido Hoss under GNU Public License V3.
+//=====================================================
+
+#include <string.h>
+#include "m2d_image.h"
+#include "m2d_trace.h"
+
+
+// m2d_trace_start()
+// Starts recording all sector accesses on the image to the
+// trace file "fname"
+//
+bool m2d_trace_start(m2d_image_t *img, const char *fname)
+{
+	struct m2d_trace_hdr_t hdr;
+	FILE *f = fopen(fname, "w");
+
+	if (f == NULL)
+		return m2d_fail(img, errno, "Can't create trace file '%s'", fname);
+
+	bzero(&hdr, sizeof(hdr));
+	memcpy(hdr.magic, M2D_TRACE_MAGIC, sizeof(hdr.magic));
+	hdr.version = M2D_TRACE_VERSION;
+	hdr.rec_sz = sizeof(struct m2d_trace_rec_t);
+
+	if (fwrite(&hdr, sizeof(hdr), 1, f) != 1)
+	{
+		fclose(f);
+		return m2d_fail(img, errno, "Can't write trace file '%s'", fname);
+	}
+
+	m2d_trace_stop(img);
+	img->trace_t0 = (uint64_t) (m2d_now() * 1e6);
+	img->trace = f;
+	return true;
+}
+
+
+// m2d_trace_stop()
+// Ends recording and closes the trace file
+//
+bool m2d_trace_stop(m2d_image_t *img)
+{
+	FILE *f = img->trace;
+
+	if (f == NULL)
+		return true;
+
+	img->trace = NULL;
+	if (ferror(f) | (fclose(f) != 0))
+		return m2d_fail(img, errno, "Can't write trace file");
+	return true;
+}
+
+
+// m2d_trace()
+// Records an access to cnt logical sectors starting at n as a
+// single request. May be called from several threads at once.
+//
+void m2d_trace(m2d_image_t *img, uint8_t op, uint16_t n, uint16_t cnt)
+{
+	if (img->trace == NULL)
+		return;
+
+	struct m2d_trace_rec_t r;
+	bzero(&r, sizeof(r));
+	r.op = op;
+
+	pthread_mutex_lock(&img->trace_lock);
+	r.usec = (uint64_t) (m2d_now() * 1e6) - img->trace_t0;
+	for (uint16_t i = 0; i < cnt; i ++)
+	{
+		r.logical = n + i;
+		r.physical = calc_image_sector(n + i);
+		r.flags = (i > 0) ? TR_CONT : 0;
+		fwrite(&r, sizeof(r), 1, img->trace);
+	}
+	pthread_mutex_unlock(&img->trace_lock);
+}
+
+
+// m2d_trace_open()
+// Checks the header of trace file f; returns FALSE if f is
+// not a trace file of this version
+//
+bool m2d_trace_open(FILE *f)
+{
+	struct m2d_trace_hdr_t hdr;
+
+	return (fread(&hdr, sizeof(hdr), 1, f) == 1)
+		&& (memcmp(hdr.magic, M2D_TRACE_MAGIC, sizeof(hdr.magic)) == 0)
+		&& (hdr.version == M2D_TRACE_VERSION)
+		&& (hdr.rec_sz == sizeof(struct m2d_trace_rec_t));
+}
+
+
+// m2d_trace_next()
+// Reads the next record of trace file f; returns FALSE at the
+// end of the trace
+//
+bool m2d_trace_next(FILE *f, struct m2d_trace_rec_t *r)
+{
+	return fread(r, sizeof(struct m2d_trace_rec_t), 1, f) == 1;
+}
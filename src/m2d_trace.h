@@ -0,0 +1,55 @@
+//=====================================================
+// m2d_trace.h
+// Sector access trace recording
+//
+// Lilith Machine Disk Utility
+//
+// Guido Hoss, 25.03.2022
+//
+// Published by Guido Hoss under GNU Public License V3.
+//=====================================================
+
+#ifndef _M2D_TRACE_H
+#define _M2D_TRACE_H   1
+
+#include "m2disk.h"
+
+
+// Trace file header; all values are in host byte order
+#define M2D_TRACE_MAGIC		"M2DTRACE"
+#define M2D_TRACE_VERSION	1
+
+struct m2d_trace_hdr_t {
+	char magic[8];			// M2D_TRACE_MAGIC
+	uint16_t version;		// M2D_TRACE_VERSION
+	uint16_t rec_sz;		// Size of a trace record
+	uint32_t reserved;
+} __attribute__((packed));
+
+// Trace operations
+#define TR_READ		0
+#define TR_WRITE	1
+
+// Trace record flags
+#define TR_CONT		1		// Continues the request of the previous record
+
+// Trace record, one per sector accessed
+struct m2d_trace_rec_t {
+	uint32_t usec;			// Time since start of trace (microseconds)
+	uint16_t logical;		// Logical sector number
+	uint16_t physical;		// Physical image sector
+	uint8_t op;				// TR_READ or TR_WRITE
+	uint8_t flags;			// TR_CONT
+	uint16_t reserved;
+} __attribute__((packed));
+
+
+// Function declarations
+//
+bool m2d_trace_start(m2d_image_t *img, const char *fname);
+bool m2d_trace_stop(m2d_image_t *img);
+void m2d_trace(m2d_image_t *img, uint8_t op, uint16_t n, uint16_t cnt);
+bool m2d_trace_open(FILE *f);
+bool m2d_trace_next(FILE *f, struct m2d_trace_rec_t *r);
+
+#endif
@@ -7,6 +7,7 @@
 // Published by Guido Hoss under GNU Public License V3.
 //=====================================================
 
+#include <config.h>
 #include "m2disk.h"
 #include "m2d_usage.h"
 
@@ -24,18 +25,35 @@ void m2d_usage()
 {
     fprintf(stderr,
         "USAGE: " PACKAGE 
-		" [-Vvlxhfic] [-d dest_dir] img_file [file_arg|files]\n\n"
+		" [-VvlnxhfictOaSrs] [-d dest_dir] [-j jobs] [-b script]\n"
+		"\t[-g cylinders] [-e pattern] [-L list_file] [-T trace_file]\n"
+		"\t[-D socket] img_file [file_args|files]\n\n"
         "-l\tList directory of img_file\n"
-        "\tIf file_arg is omitted: list all entries\n"
-        "\totherwise, list files matching regex in file_arg\n\n"
+        "\tIf file_args are omitted: list all entries\n"
+        "\totherwise, list files matching any pattern in file_args\n"
+        "-n\tList file names only (with -l)\n"
+        "-e\tExclude files matching 'pattern' (may be repeated)\n"
+        "-L\tAlso select the files named or matched by the lines\n"
+        "\tof 'list_file' ('-': standard input)\n\n"
 		"-c\tCreate and format new (empty) image file as img_file\n"
+		"-g\tCreate image with 'cylinders' cylinders (48..420, default 392)\n"
 		"-i\tImport specified files into img_file\n"
-		"-p\tList page tables of files matching file_arg\n"
-        "-x\tExtract files matching file_arg from img_file\n"
-        "-d\tExtract into destination 'dest_dir' (must already exist)\n\n"
-        "-f\tForce mode (overwrites existing files and images)\n"
+		"-p\tList page tables of files matching file_args\n"
+		"-r\tRemove (delete) files matching file_args from img_file\n"
+		"-b\tExecute the commands in file 'script' ('-': standard input)\n"
+        "-x\tExtract files matching file_args from img_file\n"
+        "-d\tExtract into destination 'dest_dir' (must already exist)\n"
+        "-O\tExtract files to standard output\n"
+        "-a\tExtract files as tar archive to standard output\n"
+        "-j\tExtract/import with 'jobs' parallel threads (default 1, at most 64)\n\n"
+        "-f\tForce mode (overwrites existing files and images,\n"
+        "\tdeletes protected files)\n"
 		"-t\tConvert text file EOL characters (Lilith<->Unix)\n"
         "-v\tVerbose output\n"
+        "-s\tSync image file to storage when writing it back\n"
+        "-S\tPrint I/O statistics (-SS: machine-readable)\n"
+        "-T\tRecord all sector accesses to 'trace_file'\n"
+        "-D\tExecute command by the m2diskd daemon listening on 'socket'\n"
        "-h\tShow this help information\n"
         "-V\tShow version information\n\n"
         "img_file is the filename of a disk image of an\n"
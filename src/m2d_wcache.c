@@ -0,0 +1,127 @@
+//=====================================================
+// m2d_wcache.c
+// Write-back sector cache
+//
+// Lilith Machine Disk Utility
+//
+// Guido Hoss, 25.03.2022
+//
+// Published by Guido Hoss under GNU Public License V3.
+//=====================================================
+
+#include <string.h>
+#include "m2d_image.h"
+#include "m2d_wcache.h"
+
+// The cache is used by images accessed with file I/O. Modified
+// sectors are kept at their physical position in a buffer of the
+// size of the image; memory is only committed for the sectors
+// actually written. Writes to a sector replace its cached copy,
+// and on flush, all dirty sectors are written in physical order
+// with one system call per contiguous run.
+
+
+// is_dirty()
+// Returns TRUE if physical sector n is in the cache
+//
+static inline bool is_dirty(m2d_image_t *img, uint16_t n)
+{
+	return (img->wdirty[n / 64] >> (n % 64)) & 1;
+}
+
+
+// m2d_wcache_put()
+// Stores sector s as the new contents of physical sector phys
+//
+bool m2d_wcache_put(m2d_image_t *img, uint16_t phys, const void *s)
+{
+	if (img->wbuf == NULL)
+	{
+		img->wbuf = malloc(img->geo.size);
+		if (img->wbuf == NULL)
+			return m2d_fail(img, errno, "Can't allocate write cache");
+	}
+
+	memcpy(img->wbuf + (size_t) phys * DK_SECTOR_SZ, s, DK_SECTOR_SZ);
+	if (! is_dirty(img, phys))
+	{
+		img->wdirty[phys / 64] |= (uint64_t) 1 << (phys % 64);
+		img->wcount ++;
+	}
+
+	// Limit the amount of unwritten data
+	return (img->wcount < M2D_WCACHE_MAX) || m2d_wcache_flush(img);
+}
+
+
+// m2d_wcache_get()
+// Copies the cached contents of physical sector phys to s.
+// Returns FALSE if the sector is not in the cache.
+//
+bool m2d_wcache_get(m2d_image_t *img, uint16_t phys, void *s)
+{
+	if ((img->wcount == 0) || (phys >= img->geo.sectors) 
+		|| (! is_dirty(img, phys)))
+		return false;
+
+	memcpy(s, img->wbuf + (size_t) phys * DK_SECTOR_SZ, DK_SECTOR_SZ);
+	return true;
+}
+
+
+// m2d_wcache_flush()
+// Writes all dirty sectors to the image file in physical order,
+// followed by fdatasync() if requested when the image was opened
+//
+bool m2d_wcache_flush(m2d_image_t *img)
+{
+	int fd = fileno(img->f);
+	uint16_t i = 0;
+
+	while (img->wcount > 0)
+	{
+		// Find next run of dirty sectors
+		while (! is_dirty(img, i))
+			i ++;
+
+		uint16_t start = i;
+		while ((i < img->geo.sectors) && is_dirty(img, i))
+			i ++;
+
+		size_t len = (size_t) (i - start) * DK_SECTOR_SZ;
+		off_t pos = (off_t) start * DK_SECTOR_SZ;
+
+		if (pwrite(fd, img->wbuf + pos, len, pos) != (ssize_t) len)
+			return m2d_fail(img, errno, "write_sector(%d) failed", start);
+
+		m2d_count_io(img, true, start, i - start, 1);
+		for (uint16_t j = start; j < i; j ++)
+			img->wdirty[j / 64] &= ~((uint64_t) 1 << (j % 64));
+		img->wcount -= i - start;
+	}
+
+	if (img->sync && (fdatasync(fd) != 0))
+		return m2d_fail(img, errno, "Can't sync image file");
+	return true;
+}
+
+
+// m2d_wcache_drop()
+// Discards all cached sectors without writing them
+//
+void m2d_wcache_drop(m2d_image_t *img)
+{
+	bzero(img->wdirty, sizeof(img->wdirty));
+	img->wcount = 0;
+}
+
+
+// m2d_wcache_free()
+// Releases the cache buffer; unwritten sectors are lost
+//
+void m2d_wcache_free(m2d_image_t *img)
+{
+	m2d_wcache_drop(img);
+	free(img->wbuf);
+	img->wbuf = NULL;
+}
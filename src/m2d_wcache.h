@@ -0,0 +1,32 @@
+//=====================================================
+// m2d_wcache.h
+// Write-back sector cache
+//
+// Lilith Machine Disk Utility
+//
+// Guido Hoss, 25.03.2022
+//
+// Published by Guido Hoss under GNU Public License V3.
+//=====================================================
+
+#ifndef _M2D_WCACHE_H
+#define _M2D_WCACHE_H   1
+
+#include "m2d_medos.h"
+
+// Number of words in the dirty sector map
+#define WCACHE_MAP_SZ	((DK_MAX_SECTORS + 63) / 64)
+
+// Number of dirty sectors after which the cache is flushed
+#define M2D_WCACHE_MAX	8192
+
+
+// Function declarations
+//
+bool m2d_wcache_put(m2d_image_t *img, uint16_t phys, const void *s);
+bool m2d_wcache_get(m2d_image_t *img, uint16_t phys, void *s);
+bool m2d_wcache_flush(m2d_image_t *img);
+void m2d_wcache_drop(m2d_image_t *img);
+void m2d_wcache_free(m2d_image_t *img);
+
+#endif
@@ -7,227 +7,106 @@
 // Published by Guido Hoss under GNU Public License V3.
 //=====================================================
 
-#include "m2disk.h"
-#include "m2d_usage.h"
-#include "m2d_extract.h"
-#include "m2d_listdir.h"
-#include "m2d_import.h"
-#include "m2d_pagemap.h"
-#include "m2d_medos.h"
+#include <string.h>
+#include <fcntl.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include "m2d_cli.h"
+#include "m2d_daemon.h"
 
 
-// Global variables
-bool verbose = false;
+// run_client()
+// Sends the command line to the m2diskd daemon listening on
+// socket "sock" and returns the exit status of the command
+//
+static int run_client(const char *sock, int argc, char **argv)
+{
+	struct sockaddr_un addr;
+	int s = socket(AF_UNIX, SOCK_STREAM, 0);
+
+	if (s == -1)
+		error(1, errno, "Can't create socket");
+
+	bzero(&addr, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	if (strlen(sock) >= sizeof(addr.sun_path))
+		error(1, 0, "Socket name '%s' too long", sock);
+	strcpy(addr.sun_path, sock);
+
+	if (connect(s, (struct sockaddr *) &addr, sizeof(addr)) != 0)
+		error(1, errno, "Can't connect to daemon at '%s'", sock);
+
+	// Concatenate all arguments
+	struct m2d_request_t req = { argc, 0 };
+	for (int i = 0; i < argc; i ++)
+		req.len += strlen(argv[i]) + 1;
+	if (req.len > M2D_MAX_REQUEST)
+		error(1, 0, "Argument list too long");
+
+	char *args = malloc(req.len);
+	if (args == NULL)
+		error(1, errno, "Can't allocate request");
+	for (int i = 0, n = 0; i < argc; i ++)
+	{
+		strcpy(args + n, argv[i]);
+		n += strlen(argv[i]) + 1;
+	}
 
-// Implemented operation modes
-typedef enum {
-	M_LISTDIR,
-	M_EXTRACT,
-	M_IMPORT,
-	M_FORMAT,
-	M_PAGETAB,
-	M_UNKNOWN
-} mode_type;
+	// The command runs with our standard streams and directory
+	int fds[M2D_REQ_FDS] = {
+		STDIN_FILENO, STDOUT_FILENO, STDERR_FILENO,
+		open(".", O_RDONLY | O_DIRECTORY)
+	};
+	if (fds[3] == -1)
+		error(1, errno, "Can't open current directory");
+
+	union {
+		struct cmsghdr hdr;
+		char buf[CMSG_SPACE(sizeof(fds))];
+	} ctl;
+	struct iovec iov = { &req, sizeof(req) };
+	struct msghdr msg = {
+		.msg_iov = &iov, .msg_iovlen = 1,
+		.msg_control = ctl.buf, .msg_controllen = sizeof(ctl.buf)
+	};
+	struct cmsghdr *cm = CMSG_FIRSTHDR(&msg);
+	cm->cmsg_level = SOL_SOCKET;
+	cm->cmsg_type = SCM_RIGHTS;
+	cm->cmsg_len = CMSG_LEN(sizeof(fds));
+	memcpy(CMSG_DATA(cm), fds, sizeof(fds));
+
+	// A daemon rejecting the request closes the connection early
+	if ((sendmsg(s, &msg, MSG_NOSIGNAL) != sizeof(req))
+		|| (send(s, args, req.len, MSG_NOSIGNAL) != req.len))
+		error(1, errno, "Can't send request to daemon");
+	free(args);
+	close(fds[3]);
+
+	// Wait for the command to finish
+	int32_t status;
+	if (read(s, &status, sizeof(status)) != sizeof(status))
+		error(1, 0, "Daemon at '%s' did not complete the request", sock);
+
+	close(s);
+	return status;
+}
 
 
 int main(int argc, char **argv)
 {
 	char c;
-	char *imgfile = NULL;
-	FILE *imgfile_fd = NULL;
-	char *outdir = NULL;
-	char *filearg = NULL;
-	mode_type mode = M_UNKNOWN;
-	bool force = false;
-	bool convert = false;
-
-	// Parse command line options
-	opterr = 0;
-	while ((c = getopt (argc, argv, "Vvlxhpftd:ic")) != -1)
-	{
-		switch (c)
-		{
-			case 'c' :
-				mode = M_FORMAT;
-				break;
-
-			case 'l' :
-				mode = M_LISTDIR;
-				break;
-
-			case 'x' :
-				mode = M_EXTRACT;
-				break;
-			
-			case 'i' :
-				mode = M_IMPORT;
-				break;
-
-			case 'p' :
-				mode = M_PAGETAB;
-				break;
-
-			case 'd' :
-				outdir = optarg;
-				break;
-
-			case 'v' :
-				verbose = true;
-				break;
-
-			case 'f' :
-				force = true;
-				break;
-
-			case 't' :
-				convert = true;
-				break;
-
-			case 'h' :
-				m2d_usage();
-				exit(0);
-
-			case 'V' :
-				m2d_version();
-				exit(0);
-
-			case '?' :
-				error(1, 0,
-					"Unrecognized option (run \"" PACKAGE " -h\" for help)."
-				);
-				break;
-
-			default :
-				break;
-		}
-	}
+	char *sock = NULL;
 
-	// Check for image_file
-	if (optind < argc)
-	{
-		// Get image file name
-		imgfile = argv[optind];
-		imgfile_fd = fopen(imgfile, "r+");
-		if (mode == M_FORMAT)
-		{
-			// In format mode, overwrite existing files only if forced
-			if (imgfile_fd == NULL)
-			{
-				imgfile_fd = fopen(imgfile, "w+");
-			} 
-			else if (force)
-			{
-				imgfile_fd = freopen(imgfile, "w+", imgfile_fd);
-			}
-			else
-			{
-				error(1, errno, 
-					"Image file '%s' exists (use -f to overwrite)",
-					imgfile
-				);
-			}
-		}
-		if (imgfile_fd == NULL)
-			error(1, errno, "Can't open image file '%s'", imgfile);
-
-		if (verbose)
-			m2d_version();
-		VERBOSE("> Image file name: %s\n", imgfile)
-	}
-	else
-	{
-		error(1, 0, "No image file specified.");
-	}
-
-	// Check for optional file_arg argument
-	switch (mode)
+	// With -D, the command is executed by a daemon
+	opterr = 0;
+	while ((c = getopt(argc, argv, M2D_OPTIONS)) != -1)
 	{
-		case M_EXTRACT :
-		case M_LISTDIR :
-		case M_PAGETAB :
-			if (optind + 1 < argc)
-				filearg = argv[optind + 1];
-			VERBOSE("> File argument: '%s'\n", filearg ? filearg : "*")
-			break;
-		
-		default :
-			break;
+		if (c == 'D')
+			sock = optarg;
 	}
 
-	if (force)
-		VERBOSE("> Force mode enabled; existing files will be overwritten\n")
-	
-	// Execute requested program function
-	switch (mode)
-	{
-		case M_LISTDIR :
-			m2d_list_dir(imgfile_fd, filearg);
-			VERBOSE("\n")
-			break;
-
-		case M_EXTRACT :
-			// Check if output directory exists and change to it	
-			if ((outdir != NULL) && (*outdir != '\0'))
-			{
-				if (chdir(outdir) != 0)
-					error(1, errno, "Invalid output directory '%s'", outdir);
-			}
-			if (verbose)
-				VERBOSE("> Destination dir: '%s'\n", outdir ? outdir : ".")
-			if (convert)
-				VERBOSE("> Text file conversion enabled\n")
-			VERBOSE("\n")
-
-			m2d_extract(imgfile_fd, filearg, force, convert);
-			break;
-
-		case M_IMPORT : {
-			// Import files into image
-			uint16_t ok = 0;
-			if (convert)
-				VERBOSE("> Text file conversion enabled\n")
-
-			// Load pagemap since we must find unused sectors
-			m2d_load_pagemap(imgfile_fd);
-
-			// Run through each source file argument
-			for (uint16_t j = optind + 1; j < argc; j ++)
-			{
-				if (m2d_import(imgfile_fd, argv[j], force, convert))
-					ok ++;
-			}
-			if (ok == 0)
-				VERBOSE("> No files imported.\n")
-			VERBOSE("\n")
-			break;
-		}
-
-		case M_FORMAT :
-			// Create new (empty) image file
-			if (m2d_init_image(imgfile_fd))
-			{
-				VERBOSE("> Image file created successfully.\n")
-			}
-			else
-			{
-				error(0, errno, "Can't create image file");
-			}
-			break;
-
-		case M_PAGETAB :
-			// Print page table of specified file(s)
-			m2d_list_pagetab(imgfile_fd, filearg);
-			break;
-
-		default :
-			error(0, 0, 
-				"Unknown or no function specified"
-				" (run \"" PACKAGE " -h\" for help)."
-			);
-			break;
-	}
+	if (sock != NULL)
+		return run_client(sock, argc, argv);
 
-	// Close image file
-	fclose(imgfile_fd);
-	return 0;
-}
\ No newline at end of file
+	return m2d_cli(argc, argv, NULL, true);
+}
@@ -18,11 +18,13 @@
 #include <stdbool.h>
 #include <ctype.h>
 #include <unistd.h>
-#include <config.h>
 
 
+// Image handle; its contents are private to the library
+typedef struct m2d_image m2d_image_t;
+
 // Verbose output macro
-extern bool verbose;
-#define VERBOSE(...)  if (verbose) printf(__VA_ARGS__);
+bool m2d_verbose(m2d_image_t *img);
+#define VERBOSE(img, ...)  if (m2d_verbose(img)) printf(__VA_ARGS__);
 
 #endif
\ No newline at end of file
@@ -0,0 +1,317 @@
+//=====================================================
+// m2diskd
+// Lilith Machine Disk Utility daemon
+//
+// Guido Hoss, 25.03.2022
+//
+// Published by Guido Hoss under GNU Public License V3.
+//=====================================================
+
+// struct ucred needs the GNU extensions
+#define _GNU_SOURCE
+
+#include <string.h>
+#include <signal.h>
+#include <fcntl.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include "libm2disk.h"
+#include "m2d_cli.h"
+#include "m2d_daemon.h"
+
+
+// Set by SIGINT and SIGTERM
+static volatile sig_atomic_t quit = false;
+
+
+// stop()
+// Signal handler which ends the daemon after the current request
+//
+static void stop(int sig)
+{
+	(void) sig;
+	quit = true;
+}
+
+
+// report()
+// Prints warnings from the library while no request is served
+//
+static void report(const char *msg)
+{
+	error(0, 0, "%s", msg);
+}
+
+
+// recv_args()
+// Receives the arguments of request req on connection s. Returns
+// them in a NULL-terminated array (to be freed by the caller), or
+// NULL if they are invalid.
+//
+static char **recv_args(int s, struct m2d_request_t *req, int *argc)
+{
+	// Each argument takes at least its terminating null
+	if ((req->argc == 0) || (req->len > M2D_MAX_REQUEST)
+		|| (req->argc > req->len))
+		return NULL;
+
+	// Arguments are stored after the pointer array
+	size_t sz = ((size_t) req->argc + 1) * sizeof(char *) + req->len + 1;
+	char **argv = malloc(sz);
+	if (argv == NULL)
+		return NULL;
+
+	char *args = (char *) &argv[req->argc + 1];
+	for (uint32_t n = 0; n < req->len; )
+	{
+		ssize_t k = read(s, args + n, req->len - n);
+
+		if (k <= 0)
+		{
+			free(argv);
+			return NULL;
+		}
+		n += k;
+	}
+	args[req->len] = '\0';
+
+	// Split arguments
+	char *p = args;
+	for (uint32_t i = 0; i < req->argc; i ++)
+	{
+		if (p >= args + req->len)
+		{
+			free(argv);
+			return NULL;
+		}
+		argv[i] = p;
+		p += strlen(p) + 1;
+	}
+	argv[req->argc] = NULL;
+	*argc = req->argc;
+	return argv;
+}
+
+
+// recv_request()
+// Receives a request on connection s. Returns its arguments in
+// a NULL-terminated array (to be freed by the caller) and the
+// passed file descriptors in fds, or NULL if the request is invalid.
+// The descriptors of an invalid request are closed.
+//
+static char **recv_request(int s, int *argc, int *fds)
+{
+	struct m2d_request_t req;
+	union {
+		struct cmsghdr hdr;
+		char buf[CMSG_SPACE(M2D_REQ_FDS * sizeof(int))];
+	} ctl;
+	struct iovec iov = { &req, sizeof(req) };
+	struct msghdr msg = {
+		.msg_iov = &iov, .msg_iovlen = 1,
+		.msg_control = ctl.buf, .msg_controllen = sizeof(ctl.buf)
+	};
+	ssize_t k = recvmsg(s, &msg, MSG_CMSG_CLOEXEC);
+
+	// Take over whatever descriptors arrived, even if the
+	// request is incomplete
+	struct cmsghdr *cm = (k >= 0) ? CMSG_FIRSTHDR(&msg) : NULL;
+	uint16_t nfds = 0;
+
+	if ((cm != NULL) && (cm->cmsg_level == SOL_SOCKET)
+		&& (cm->cmsg_type == SCM_RIGHTS) && (cm->cmsg_len >= CMSG_LEN(0)))
+	{
+		nfds = (cm->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+		if (nfds > M2D_REQ_FDS)
+			nfds = M2D_REQ_FDS;
+		memcpy(fds, CMSG_DATA(cm), nfds * sizeof(int));
+	}
+
+	char **argv = NULL;
+	if ((k == sizeof(req)) && (nfds == M2D_REQ_FDS))
+		argv = recv_args(s, &req, argc);
+
+	if (argv == NULL)
+	{
+		for (uint16_t i = 0; i < nfds; i ++)
+			close(fds[i]);
+	}
+	return argv;
+}
+
+
+// peer_allowed()
+// Returns TRUE if the client on connection s runs under the
+// daemon's user id; other users must not access the image
+//
+static bool peer_allowed(int s)
+{
+	struct ucred cred;
+	socklen_t len = sizeof(cred);
+
+	if (getsockopt(s, SOL_SOCKET, SO_PEERCRED, &cred, &len) != 0)
+	{
+		error(0, errno, "Can't identify client");
+		return false;
+	}
+	if (cred.uid != geteuid())
+	{
+		error(0, 0, "Request from user %d rejected", cred.uid);
+		return false;
+	}
+	return true;
+}
+
+
+// serve()
+// Executes one request on connection s against the image.
+// The command runs with the client's standard streams and
+// current directory, which are restored afterwards.
+//
+static void serve(int s, m2d_image_t *img)
+{
+	int fds[M2D_REQ_FDS];
+	int argc;
+	char **argv = recv_request(s, &argc, fds);
+
+	if (argv == NULL)
+	{
+		error(0, 0, "Invalid request ignored");
+		return;
+	}
+
+	int saved[3] = { dup(STDIN_FILENO), dup(STDOUT_FILENO), dup(STDERR_FILENO) };
+	int home = open(".", O_RDONLY | O_DIRECTORY);
+	int32_t status = 1;
+
+	fflush(stdout);
+	fflush(stderr);
+	if ((dup2(fds[0], STDIN_FILENO) != -1)
+		&& (dup2(fds[1], STDOUT_FILENO) != -1)
+		&& (dup2(fds[2], STDERR_FILENO) != -1))
+	{
+		if (fchdir(fds[3]) == 0)
+			status = m2d_cli(argc, argv, img, true);
+		else
+			error(0, errno, "Can't change to client directory");
+	}
+	fflush(stdout);
+	fflush(stderr);
+
+	for (int i = 0; i < 3; i ++)
+	{
+		dup2(saved[i], i);
+		close(saved[i]);
+	}
+	if ((home == -1) || (fchdir(home) != 0))
+		error(0, errno, "Can't change back to daemon directory");
+	close(home);
+	for (int i = 0; i < M2D_REQ_FDS; i ++)
+		close(fds[i]);
+	free(argv);
+
+	// Options of the request don't carry over to the next one
+	m2d_set_report(img, report);
+	m2d_set_verbose(img, false);
+	m2d_stats_start(img, false);
+	if (write(s, &status, sizeof(status)) != sizeof(status))
+		error(0, errno, "Can't send reply");
+}
+
+
+int main(int argc, char **argv)
+{
+	bool force = false;
+	uint16_t flags = 0;
+	char c;
+
+	while ((c = getopt(argc, argv, "fs")) != -1)
+	{
+		switch (c)
+		{
+			case 'f' :
+				// Remove a stale socket
+				force = true;
+				break;
+
+			case 's' :
+				flags |= M2D_SYNC;
+				break;
+
+			default :
+				error(1, 0, "USAGE: m2diskd [-fs] img_file socket");
+				break;
+		}
+	}
+	if (argc - optind != 2)
+		error(1, 0, "USAGE: m2diskd [-fs] img_file socket");
+
+	char *imgfile = argv[optind];
+	char *sock = argv[optind + 1];
+
+	// Open the image and load its directory and page map once
+	m2d_image_t *img = m2d_open(imgfile, flags);
+	if (img == NULL)
+		error(1, errno, "Can't open image file '%s'", imgfile);
+	m2d_set_report(img, report);
+
+	if (! (m2d_dircache_load(img) && m2d_get_pagemap(img)))
+		error(1, 0, "%s", m2d_error(img));
+
+	// Listen on the socket
+	struct sockaddr_un addr;
+	int ls = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+
+	if (ls == -1)
+		error(1, errno, "Can't create socket");
+
+	bzero(&addr, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	if (strlen(sock) >= sizeof(addr.sun_path))
+		error(1, 0, "Socket name '%s' too long", sock);
+	strcpy(addr.sun_path, sock);
+
+	if (force)
+		unlink(sock);
+
+	// Only the daemon's user may connect; the socket is created
+	// without group and other permissions
+	mode_t mask = umask(S_IRWXG | S_IRWXO);
+	int res = bind(ls, (struct sockaddr *) &addr, sizeof(addr));
+	umask(mask);
+
+	if ((res != 0) || (chmod(sock, S_IRUSR | S_IWUSR) != 0)
+		|| (listen(ls, 16) != 0))
+		error(1, errno, "Can't listen on socket '%s'", sock);
+
+	// Accept requests until terminated; accept() is interrupted
+	// by the signals since they are installed without SA_RESTART
+	struct sigaction sa;
+	bzero(&sa, sizeof(sa));
+	sa.sa_handler = stop;
+	sigaction(SIGINT, &sa, NULL);
+	sigaction(SIGTERM, &sa, NULL);
+	signal(SIGPIPE, SIG_IGN);
+
+	while (! quit)
+	{
+		int s = accept(ls, NULL, NULL);
+
+		if (s == -1)
+		{
+			if (errno != EINTR)
+				error(0, errno, "Can't accept connection");
+			continue;
+		}
+		if (peer_allowed(s))
+			serve(s, img);
+		close(s);
+	}
+
+	close(ls);
+	unlink(sock);
+	if (! m2d_close(img))
+		error(1, 0, "Image file '%s' not updated", imgfile);
+	return 0;
+}